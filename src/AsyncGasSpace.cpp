@@ -0,0 +1,187 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#include "AsyncGasSpace.hpp"
+
+#include <tuple>
+
+AsyncGasSpace::AsyncGasSpace(uint seed)
+:   m_seed(seed)
+,   m_space(seed)
+{
+    // The worker has all the time it needs to split sectors, but should
+    // get back to new edits promptly
+    m_space.set_lazy_partition(true);
+    m_current = build_layout(m_space.layout());
+    m_thread = std::thread(&AsyncGasSpace::worker, this);
+}
+
+AsyncGasSpace::~AsyncGasSpace(){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+void AsyncGasSpace::step(float delta){
+    swap_layout();
+    m_current->graph->step(delta);
+}
+
+void AsyncGasSpace::step_n(float delta, uint count){
+    swap_layout();
+    m_current->graph->step_n(delta, count);
+}
+
+void AsyncGasSpace::set_sleep_tolerance(float tolerance){
+    m_sleep_tolerance = tolerance;
+    m_current->graph->set_sleep_tolerance(tolerance);
+}
+
+void AsyncGasSpace::block(Volume volume){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_edits.emplace_back(volume, true);
+        m_queued++;
+    }
+    m_wake.notify_all();
+}
+
+void AsyncGasSpace::clear(Volume volume){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_edits.emplace_back(volume, false);
+        m_queued++;
+    }
+    m_wake.notify_all();
+}
+
+void AsyncGasSpace::flush(){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_published.wait(lock, [this]{ return m_applied == m_queued; });
+    }
+    swap_layout();
+}
+
+float AsyncGasSpace::air_at(Point point) const {
+    int sector = find_sector(point);
+    if(sector >= 0)
+        return m_current->graph->density(m_current->nodes[sector]);
+    return 0;
+}
+
+void AsyncGasSpace::add_air(Point point, float value){
+    int sector = find_sector(point);
+    if(sector >= 0){
+        auto node = m_current->nodes[sector];
+        m_current->graph->set_gas_mass(node, m_current->graph->gas_mass(node) + value);
+    }
+}
+
+uint AsyncGasSpace::size() const {
+    return m_current->nodes.size();
+}
+
+//
+//      Publishing layouts
+//
+
+void AsyncGasSpace::worker(){
+    uint64_t taken = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true){
+        m_wake.wait(lock, [this]{ return m_stopping || !m_edits.empty(); });
+        if(m_stopping) return;
+
+        auto edits = std::move(m_edits);
+        m_edits.clear();
+        taken += edits.size();
+        lock.unlock();
+
+        m_space.begin_edit();
+        for(auto edit : edits){
+            if(edit.second) m_space.block(edit.first);
+            else m_space.clear(edit.first);
+        }
+        m_space.commit();
+
+        // Split badly shaped sectors, unless more edits turn up first. Any
+        // left over are picked up after those edits.
+        while(m_space.maintain(1000) > 0){
+            std::unique_lock<std::mutex> check(m_mutex);
+            if(m_stopping || !m_edits.empty()) break;
+        }
+
+        auto layout = build_layout(m_space.layout());
+
+        lock.lock();
+        m_pending = std::move(layout);
+        m_applied = taken;
+        m_published.notify_all();
+    }
+}
+
+auto AsyncGasSpace::build_layout(const GasSpace::Layout& source) const -> std::unique_ptr<Layout> {
+    std::unique_ptr<Layout> layout(new Layout);
+    layout->graph.reset(new GasGraph(m_seed));
+
+    for(uint ii = 0; ii < source.sectors.size(); ii++){
+        auto& sector = source.sectors[ii];
+        auto node = layout->graph->new_node();
+        layout->graph->set_volume(node, sector.volume());
+        layout->graph->set_surface(node, sector.surface());
+        layout->nodes.push_back(node);
+
+        for(auto part : sector){
+            layout->lookup.insert(layout->parts.size(), part);
+            layout->parts.push_back(part);
+            layout->part_sector.push_back(ii);
+        }
+    }
+
+    for(auto edge : source.edges)
+        layout->graph->set_edge(layout->nodes[std::get<0>(edge)], layout->nodes[std::get<1>(edge)], std::get<2>(edge));
+
+    return layout;
+}
+
+void AsyncGasSpace::swap_layout(){
+    std::unique_ptr<Layout> next;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        next = std::move(m_pending);
+    }
+    if(!next) return;
+
+    // Each new sector takes gas from the old sectors it overlaps, at their
+    // density. Gas in space that has been blocked is lost.
+    auto& old = *m_current;
+    std::vector<float> mass(next->nodes.size(), 0);
+    for(uint ii = 0; ii < next->parts.size(); ii++){
+        auto part = next->parts[ii];
+        for(auto old_part : old.lookup.intersecting(part)){
+            auto node = old.nodes[old.part_sector[old_part]];
+            float overlap = (part & old.parts[old_part]).volume();
+            mass[next->part_sector[ii]] += old.graph->density(node) * overlap;
+        }
+    }
+    for(uint ii = 0; ii < mass.size(); ii++)
+        next->graph->set_gas_mass(next->nodes[ii], mass[ii]);
+    next->graph->set_sleep_tolerance(m_sleep_tolerance);
+
+    m_current = std::move(next);
+}
+
+int AsyncGasSpace::find_sector(Point point) const {
+    auto result = m_current->lookup.intersecting(point);
+    if(result.size() > 0)
+        return m_current->part_sector[result.front()];
+    return -1;
+}
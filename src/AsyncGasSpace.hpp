@@ -0,0 +1,107 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#ifndef HPPB_SRC_ASYNCGASSPACE_HPP
+#define HPPB_SRC_ASYNCGASSPACE_HPP
+
+#include "definitions.hpp"
+
+#include "GasGraph.hpp"
+#include "GasSpace.hpp"
+#include "RTree.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A GasSpace with its topology maintained on a worker thread.
+ *
+ * Edits are queued for the worker, which applies them (and any splitting of
+ * sectors) to its own GasSpace, then publishes the resulting layout of
+ * sectors as a new gas graph. The simulation picks up the latest layout at
+ * the start of a step, moving the gas from the old sectors into the new ones
+ * by how much they overlap. Stepping never waits on the worker.
+ */
+class AsyncGasSpace {
+public:
+    // Construct/Destruct
+    AsyncGasSpace(uint);
+    ~AsyncGasSpace();
+
+public:
+    // Let the gas flow between the nodes a bit, after switching to the
+    // latest published layout.
+    void step(float);
+    void step_n(float, uint);
+    // Let settled sectors stop being stepped, as GasSpace does. Layouts
+    // published later pick up the same tolerance.
+    void set_sleep_tolerance(float);
+
+public:
+    // Queue changes to the space for the worker
+    void block(Volume);
+    void clear(Volume);
+
+    // Wait until all queued edits are published, and switch to them
+    void flush();
+
+public:
+    // Measure how much gas is at a point in space
+    float air_at(Point) const;
+    // Add gas to a point in space.
+    void add_air(Point, float);
+
+    // How many sectors the simulation is using
+    uint size() const;
+
+protected:
+    // The arrangement of sectors the simulation runs on. Each part of each
+    // sector is indexed separately, and knows its sector.
+    struct Layout {
+        std::vector<Volume> parts;
+        std::vector<uint> part_sector;
+        RTree<uint> lookup;
+        std::unique_ptr<GasGraph> graph;
+        std::vector<GasGraph::Node> nodes;
+    };
+
+    // Loop run by the worker thread
+    void worker();
+    // Turn the worker's copy of the sectors into a layout to publish
+    std::unique_ptr<Layout> build_layout(const GasSpace::Layout&) const;
+    // Switch to the latest published layout, if there is one
+    void swap_layout();
+    // Find the sector at a point in the current layout, or -1
+    int find_sector(Point) const;
+
+protected:
+    const uint m_seed;
+
+    // Only used by the worker thread once it is running
+    GasSpace m_space;
+    // Only used by the simulation thread
+    std::unique_ptr<Layout> m_current;
+    float m_sleep_tolerance = 0;
+
+    // Shared between the threads
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_published;
+    std::vector<std::pair<Volume, bool>> m_edits;
+    std::unique_ptr<Layout> m_pending;
+    // Count of edits queued, and included in the last published layout
+    uint64_t m_queued = 0;
+    uint64_t m_applied = 0;
+    bool m_stopping = false;
+
+    std::thread m_thread;
+};
+
+#endif
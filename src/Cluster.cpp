@@ -251,6 +251,14 @@ bool Cluster::adjacent(Volume other) const {
     return false;
 }
 
+bool Cluster::overlap(Volume other) const {
+    for(auto part : m_volumes){
+        if(part.overlap(other))
+            return true;
+    }
+    return false;
+}
+
 float Cluster::contact(const Cluster& b) const {
     float out = 0;
     for(auto a_part : m_volumes){
@@ -261,6 +269,13 @@ float Cluster::contact(const Cluster& b) const {
     return out;
 }
 
+float Cluster::contact(Volume other) const {
+    float out = 0;
+    for(auto part : m_volumes)
+        out += part.contact(other);
+    return out;
+}
+
 std::vector<Cluster> Cluster::connected_components() const {
     auto input = m_volumes;
     std::vector<Cluster> output;
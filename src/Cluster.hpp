@@ -92,6 +92,7 @@ public:
 
     // Calculate the surface area in contact between two sets of volumes
     float contact(const Cluster&) const;
+    float contact(Volume) const;
     bool overlap(Volume) const;
 
     // Return the set of volumes broken into connected sections
@@ -6,10 +6,11 @@
  * Copyright 2017 Adam Douglass
  */
 #include "GasGraph.hpp"
+#include "flux.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
-#include <unordered_set>
 #include <cassert>
 #include <fstream>
 
@@ -27,119 +28,643 @@ constexpr float ideal_gas_constant = 8.3144; // J / (K mol)
 constexpr float molar_mass_air = 0.029; // kg/mol
 constexpr float specific_constant_air = ideal_gas_constant/molar_mass_air; // J/(kg K)
 constexpr float air_viscosity = 0.01; // 1.81e-5; // kg/(m*s)
+constexpr float pressure_scale = specific_constant_air * temperature_kelvin;
 
 //
+//      Node state
 //
+
+float GasGraph::gas_mass(Node node) const {
+    return m_gas_mass[index(node)];
+}
+
+void GasGraph::set_gas_mass(Node node, float value){
+    m_gas_mass[index(node)] = value;
+    wake(index(node));
+}
+
+float GasGraph::volume(Node node) const {
+    return m_volume[index(node)];
+}
+
+void GasGraph::set_volume(Node node, float value){
+    m_volume[index(node)] = value;
+    m_levels_dirty = true;
+    wake(index(node));
+}
+
+float GasGraph::surface(Node node) const {
+    return m_surface[index(node)];
+}
+
+void GasGraph::set_surface(Node node, float value){
+    m_surface[index(node)] = value;
+}
+
+float GasGraph::density(Node node) const {
+    return density(index(node));
+}
+
+float GasGraph::pressure(Node node) const {
+    return pressure(index(node));
+}
+
+float GasGraph::density(uint node) const {
+    return m_gas_mass[node] / m_volume[node];
+}
+
+float GasGraph::pressure(uint node) const {
+    return density(node) * pressure_scale;
+}
+
+auto GasGraph::neighbours(Node node) const -> std::vector<std::pair<Node, float>> {
+    std::vector<std::pair<Node, float>> out;
+    uint begin = m_row_begin[index(node)];
+    uint end = begin + m_row_count[index(node)];
+    for(uint ee = begin; ee < end; ee++){
+        if(m_edge_valve[m_entry_edge[ee]]) continue;
+        uint slot = m_node_slot[m_entry_target[ee]];
+        out.emplace_back(Node{m_slot_generation[slot] << slot_bits | slot}, m_edge_surface[m_entry_edge[ee]]);
+    }
+    return out;
+}
+
+//
+//      Handles
 //
 
-float GasGraph::Node::density() const {
-    return gas_mass / volume;
+bool GasGraph::valid(Node node) const {
+    uint slot = node.id & slot_mask;
+    uint32_t generation = node.id >> slot_bits;
+    return generation != 0 && slot < m_slot_generation.size() && m_slot_generation[slot] == generation;
 }
 
-float GasGraph::Node::pressure() const {
-    return density() * specific_constant_air * temperature_kelvin;
+uint GasGraph::index(Node node) const {
+    assert(valid(node));
+    return m_slot_index[node.id & slot_mask];
 }
 
 //
 //
 //
 
+constexpr uint GasGraph::no_edge;
+constexpr uint GasGraph::no_node;
+constexpr uint GasGraph::slot_bits;
+constexpr uint32_t GasGraph::slot_mask;
+constexpr uint32_t GasGraph::max_generation;
+
 GasGraph::GasGraph(uint seed) : m_prng(seed){}
-GasGraph::~GasGraph(){
-    for(auto node : m_nodes) delete node;
-}
+GasGraph::~GasGraph(){}
 
 void GasGraph::step(float delta){
+    step_n(delta, 1);
+}
+
+void GasGraph::step_n(float delta, uint count){
+    // Nothing can edit the graph between these ticks, so anything that
+    // depends on the topology is prepared once here. Each mode keeps its
+    // own state up to date as it goes, and its scratch space between calls.
+    for(uint ii = 0; ii < m_source_node.size(); ii++)
+        if(m_source_rate[ii] != 0 && valid(m_source_node[ii]))
+            wake(index(m_source_node[ii]));
+    prune_awake();
+    if(m_mode == StepMode::Colored)
+        update_color_classes();
+
+    for(uint tick = 0; tick < count; tick++){
+        apply_sources(delta);
+        switch(m_mode){
+        case StepMode::Shuffled: step_shuffled(delta); break;
+        case StepMode::Colored: step_colored(delta); break;
+        case StepMode::Jacobi: step_jacobi(delta); break;
+        case StepMode::Implicit: step_implicit(delta); break;
+        case StepMode::Multirate: step_multirate(delta); break;
+        }
+        refill_reservoirs();
+    }
+}
+
+void GasGraph::set_mode(StepMode mode){
+    // Only some modes keep track of sleeping nodes, so start fresh
+    m_mode = mode;
+    wake_all();
+}
+
+auto GasGraph::mode() const -> StepMode {
+    return m_mode;
+}
+
+void GasGraph::set_threads(uint threads){
+    m_pool.resize(std::max(1u, threads));
+}
+
+uint GasGraph::solver_iterations() const {
+    return m_solver_iterations;
+}
+
+uint GasGraph::substeps() const {
+    return m_substeps;
+}
+
+void GasGraph::set_sleep_tolerance(float tolerance){
+    m_sleep_tolerance = tolerance;
+    if(tolerance <= 0) wake_all();
+}
+
+void GasGraph::wake(Node node){
+    wake(index(node));
+}
+
+bool GasGraph::awake(Node node) const {
+    return m_awake[index(node)] != 0;
+}
+
+uint GasGraph::awake_count() const {
+    return m_awake_nodes.size();
+}
+
+void GasGraph::step_shuffled(float delta){
     // We are going to make an effort to not process connected nodes in sequence.
-    std::unordered_set<Node*> remaining(m_nodes.begin(), m_nodes.end());
+    m_remaining.assign(m_awake_nodes.begin(), m_awake_nodes.end());
+    m_blocked.resize(m_node_slot.size(), 0);
 
     // Keep going until all the nodes get done
-    while(!remaining.empty()){
+    while(!m_remaining.empty()){
         // For each round of stepping nodes we will avoid those adjacent to
-        // those already steppeed in this round.
-        std::unordered_set<Node*> adjacent;
+        // those already steppeed in this round. Nodes are blocked by marking
+        // them with the number of the round, so nothing needs clearing.
+        if(++m_round == 0){
+            std::fill(m_blocked.begin(), m_blocked.end(), 0);
+            m_round = 1;
+        }
 
         // Each pass should see the nodes in a different order
-        auto copy = std::vector<Node*>(remaining.begin(), remaining.end());
-        std::shuffle(copy.begin(), copy.end(), m_prng);
+        std::shuffle(m_remaining.begin(), m_remaining.end(), m_prng);
 
-        for(auto node : copy) {
+        uint kept = 0;
+        for(auto node : m_remaining) {
             // Skip nodes adjacent to those already done until the next pass
-            if(adjacent.count(node)) continue;
+            if(m_blocked[node] == m_round){
+                m_remaining[kept++] = node;
+                continue;
+            }
 
             // Do the node
             step_node(node, delta);
-            remaining.erase(node);
+            update_sleep(node);
 
             // forbid the neighbours until the next round
-            for(auto edge : node->edges)
-                adjacent.insert(edge.other);
+            uint begin = m_row_begin[node];
+            uint end = begin + m_row_count[node];
+            for(uint ee = begin; ee < end; ee++)
+                m_blocked[m_entry_target[ee]] = m_round;
         }
+        m_remaining.resize(kept);
     }
+
+    collect_awake();
 }
 
-void GasGraph::step_node(Node* node, float delta_time){
-    // If the node has no space or is disconnected we can stop early
-    if(node->volume == 0) return;
-    if(node->edges.empty()) return;
+void GasGraph::step_colored(float delta){
+    // Still vary the order between steps, but only of the colours; the order
+    // within a colour doesn't matter as none of the nodes interact.
+    m_color_order.resize(m_color_begin.size() - 1);
+    for(uint ii = 0; ii < m_color_order.size(); ii++) m_color_order[ii] = ii;
+    std::shuffle(m_color_order.begin(), m_color_order.end(), m_prng);
 
-    // We'll calculate these values for each connection with another node
-    std::vector<float> mass_flows;
-    std::vector<float> acceleration, velocity;
+    for(auto color : m_color_order){
+        const uint * nodes = m_color_nodes.data() + m_color_begin[color];
+        m_pool.run(m_color_begin[color + 1] - m_color_begin[color], [&](uint begin, uint end){
+            for(uint ii = begin; ii < end; ii++){
+                step_node(nodes[ii], delta);
+                update_sleep(nodes[ii]);
+            }
+        });
+    }
 
-    // Use the pressure gradient on each opening to the node to calculate the gas
-    // flow in/out
-    for(auto& edge : node->edges){
-        auto other = edge.other;
-
-        // If the other node has no volume or both this and the other node
-        // are nearly empty, then we can assume nothing interesting is happening here
-        if(other->volume == 0 || (node->gas_mass < almost_nothing && other->gas_mass < almost_nothing)){
-            mass_flows.push_back(0);
-            acceleration.push_back(0);
-            velocity.push_back(0);
-            continue;
+    // Only sleeping changes which nodes are stepped between ticks
+    collect_awake();
+    if(m_sleep_tolerance > 0)
+        update_color_classes();
+}
+
+void GasGraph::step_jacobi(float delta){
+    // Every edge's flow is worked out from the state at the start of the
+    // step, and applied to both of its ends. Every value is written by
+    // exactly one pass over either the edges or the nodes, so the result
+    // doesn't depend on how the work is split between threads.
+    const uint edges = m_edge_a.size();
+    const uint nodes = m_node_slot.size();
+    for(auto array : {&m_density_a, &m_density_b, &m_open, &m_flux, &m_flux_acceleration, &m_flux_velocity})
+        array->resize(edges);
+    m_out_scale.resize(nodes);
+    m_gas_mass_back.resize(nodes);
+
+    // Work through the edge table in blocks
+    const uint block = 1024;
+    const uint blocks = (edges + block - 1)/block;
+
+    // Find the raw flow through every edge
+    m_pool.run(blocks, [&](uint first, uint last){
+        uint begin = first * block;
+        uint end = std::min(last * block, edges);
+
+        for(uint edge = begin; edge < end; edge++){
+            uint a = m_edge_a[edge], b = m_edge_b[edge];
+            bool open = a != no_node && moving(a, b);
+            m_density_a[edge] = open ? density(a) : 0;
+            m_density_b[edge] = open ? density(b) : 0;
+            m_open[edge] = open ? 1 : 0;
+        }
+
+        flux(FluxBatch{
+            &m_density_a[begin], &m_density_b[begin], &m_open[begin],
+            &m_edge_surface[begin], &m_edge_acceleration[begin], &m_edge_velocity[begin],
+            &m_flux[begin], &m_flux_acceleration[begin], &m_flux_velocity[begin],
+            pressure_scale
+        }, end - begin, delta);
+    });
+
+    apply_fluxes();
+}
+
+void GasGraph::step_implicit(float delta){
+    // Solve for the pressures at the end of the step, with the flow through
+    // each edge proportional to the pressure difference at the end of the
+    // step (backward Euler). The mass in each node is
+    //
+    //     m' = m + sum(k (p'_other - p'))
+    //
+    // and with p' = m' scale / volume that gives a symmetric positive
+    // definite system for p'. The conductance k of the edges uses the
+    // densities from the start of the step.
+    const uint edges = m_edge_a.size();
+    const uint nodes = m_node_slot.size();
+    for(auto array : {&m_flux, &m_flux_acceleration, &m_flux_velocity, &m_conductance})
+        array->resize(edges);
+    for(auto array : {&m_solve_diagonal, &m_solve_rhs, &m_solve_x})
+        array->resize(nodes);
+    m_solve_fixed.assign(nodes, 0);
+    for(auto slot : m_reservoir_slots)
+        m_solve_fixed[m_slot_index[slot]] = 1;
+
+    const uint block = 1024;
+    const uint blocks = (edges + block - 1)/block;
+
+    m_pool.run(blocks, [&](uint first, uint last){
+        uint end = std::min(last * block, edges);
+        for(uint edge = first * block; edge < end; edge++){
+            uint a = m_edge_a[edge], b = m_edge_b[edge];
+            if(a == no_node || !moving(a, b)){
+                m_conductance[edge] = 0;
+                continue;
+            }
+
+            float density = (this->density(a) + this->density(b)) * 0.5f;
+            m_conductance[edge] = delta * m_edge_surface[edge] * density / (air_viscosity * flow_distance);
         }
+    });
 
-        // TODO I think this needs a distance component, possibly add the distance
-        // from node's center of mass to each edge
-        float distance = 1.0;
-        float pressure_gradient = (other->pressure() - node->pressure())/distance;
+    // Fill in the system, starting from the current pressure. Empty space has
+    // nothing to solve for, so gets a trivial row. Reservoirs hold their
+    // pressure, so their terms move over to the right hand side.
+    m_pool.run(nodes, [&](uint first, uint last){
+        for(uint node = first; node < last; node++){
+            if(m_volume[node] == 0){
+                m_solve_diagonal[node] = 1;
+                m_solve_rhs[node] = 0;
+                m_solve_x[node] = 0;
+                continue;
+            }
+            double pressure = double(m_gas_mass[node]) * pressure_scale / m_volume[node];
+            if(m_solve_fixed[node]){
+                m_solve_diagonal[node] = 1;
+                m_solve_rhs[node] = m_solve_x[node] = pressure;
+                continue;
+            }
 
-        // Divide by density to get the presure contribution to flow acceleration
-        float density = (node->density() + other->density())/2.0;
-        float new_flow_acceleration = pressure_gradient/density;
+            double diagonal = m_volume[node] / pressure_scale;
+            double rhs = m_gas_mass[node];
+            const uint begin = m_row_begin[node];
+            const uint end = begin + m_row_count[node];
+            for(uint ee = begin; ee < end; ee++){
+                float conductance = m_conductance[m_entry_edge[ee]];
+                diagonal += conductance;
+                uint other = m_entry_target[ee];
+                if(m_solve_fixed[other])
+                    rhs += conductance * double(m_gas_mass[other]) * pressure_scale / m_volume[other];
+            }
 
-        // Get the average acceleration in the period between the last update
-        // and this one
-        float current_flow_acceleration = (edge.acceleration + new_flow_acceleration)/2.0;
+            m_solve_diagonal[node] = diagonal;
+            m_solve_rhs[node] = rhs;
+            m_solve_x[node] = pressure;
+        }
+    });
 
-        // Calculate a velocity and flow
-        float flow_velocity = current_flow_acceleration * delta_time + edge.velocity/2.0;
-        float volumetric_flow = (flow_velocity + edge.velocity)/2.0 * edge.surface;
+    solve_pressure();
 
-        // Convert to mass and store the values we have found
-        float mass_flow = volumetric_flow * density * delta_time;
-        mass_flows.push_back(mass_flow);
-        acceleration.push_back(new_flow_acceleration);
-        velocity.push_back(flow_velocity);
+    // Turn the pressures into flows through each edge, stored as the flow
+    // into the first node of the edge.
+    m_pool.run(blocks, [&](uint first, uint last){
+        uint end = std::min(last * block, edges);
+        for(uint edge = first * block; edge < end; edge++){
+            if(m_conductance[edge] == 0){
+                m_flux[edge] = m_flux_acceleration[edge] = m_flux_velocity[edge] = 0;
+                continue;
+            }
+            double difference = m_solve_x[m_edge_b[edge]] - m_solve_x[m_edge_a[edge]];
+            m_flux[edge] = m_conductance[edge] * difference;
+            m_flux_acceleration[edge] = 0;
+            m_flux_velocity[edge] = difference / air_viscosity;
+        }
+    });
+
+    // The solve is inexact, so the flows are still limited. A node between
+    // a reservoir and a vacuum passes gas along within the step, so what
+    // it gets from the reservoir counts toward what it can give.
+    apply_fluxes(true);
+}
+
+void GasGraph::step_multirate(float delta){
+    // Each edge is stepped as often as the smaller of its two nodes needs.
+    // The fastest edges are stepped 2^top times, an edge of level L is
+    // stepped every 2^(top - L) of those substeps with 2^(top - L) times
+    // the time step. Every flow is applied to both ends of its edge, so
+    // mass is conserved however the levels are mixed.
+    if(m_levels_dirty || delta != m_levels_delta)
+        update_levels(delta);
+
+    const uint top = m_level_begin.size() - 2;
+    const uint count = m_level_edges.size();
+    for(auto array : {&m_density_a, &m_density_b, &m_open, &m_flux, &m_flux_acceleration, &m_flux_velocity})
+        array->resize(count);
+    m_out_scale.assign(m_node_slot.size(), 0);
+
+    m_substeps = 1u << top;
+    for(uint sub = 0; sub < m_substeps; sub++){
+        // Levels from this one up are due, every level is due at the start
+        uint lowest = 0;
+        if(sub != 0) lowest = top - std::min<uint>(top, __builtin_ctz(sub));
+
+        for(uint level = lowest; level <= top; level++){
+            const uint begin = m_level_begin[level];
+            const uint end = m_level_begin[level + 1];
+            for(uint ii = begin; ii < end; ii++){
+                uint edge = m_level_edges[ii];
+                uint a = m_edge_a[edge], b = m_edge_b[edge];
+                bool open = moving(a, b);
+                m_density_a[ii] = open ? density(a) : 0;
+                m_density_b[ii] = open ? density(b) : 0;
+                m_open[ii] = open ? 1 : 0;
+                m_flux_acceleration[ii] = m_edge_acceleration[edge];
+                m_flux_velocity[ii] = m_edge_velocity[edge];
+            }
+
+            flux(FluxBatch{
+                &m_density_a[begin], &m_density_b[begin], &m_open[begin],
+                &m_level_surface[begin], &m_flux_acceleration[begin], &m_flux_velocity[begin],
+                &m_flux[begin], &m_flux_acceleration[begin], &m_flux_velocity[begin],
+                pressure_scale
+            }, end - begin, delta / (1u << level));
+        }
+
+        apply_level_fluxes(m_level_begin[lowest], count);
+    }
+}
+
+void GasGraph::apply_level_fluxes(uint begin, uint end){
+    // Total up what each node is giving, in m_out_scale
+    for(uint ii = begin; ii < end; ii++){
+        uint edge = m_level_edges[ii];
+        if(m_flux[ii] < 0) m_out_scale[m_edge_a[edge]] -= m_flux[ii];
+        else m_out_scale[m_edge_b[edge]] += m_flux[ii];
+    }
+
+    // Scale every flow out of a node by the same amount, as apply_fluxes
+    // does, so together they can't take more than it has
+    for(uint ii = begin; ii < end; ii++){
+        uint edge = m_level_edges[ii];
+        uint giver = m_flux[ii] < 0 ? m_edge_a[edge] : m_edge_b[edge];
+        float out_flow = m_out_scale[giver];
+        float scale = out_flow <= 0 ? 0 : std::min(1.0f, m_gas_mass[giver]/out_flow);
+        m_flux[ii] *= scale;
+        m_edge_acceleration[edge] = m_flux_acceleration[ii] * scale;
+        m_edge_velocity[edge] = m_flux_velocity[ii] * scale;
+    }
+
+    // Move the gas, and leave the totals at zero for next time
+    for(uint ii = begin; ii < end; ii++){
+        uint edge = m_level_edges[ii];
+        uint a = m_edge_a[edge], b = m_edge_b[edge];
+        m_gas_mass[a] += m_flux[ii];
+        m_gas_mass[b] -= m_flux[ii];
+        m_out_scale[a] = m_out_scale[b] = 0;
+    }
+
+    // Only once every flow is in, a node drained completely can land a
+    // rounding error below zero
+    for(uint ii = begin; ii < end; ii++){
+        uint edge = m_level_edges[ii];
+        for(auto node : {m_edge_a[edge], m_edge_b[edge]})
+            m_gas_mass[node] = std::max(0.0f, m_gas_mass[node]);
     }
+}
+
+void GasGraph::update_levels(float delta){
+    // A rough stable time step for each node. The flow out of a node grows
+    // with the square of the time step and the surface it has to lose gas
+    // through, relative to how much gas it holds.
+    const uint nodes = m_node_slot.size();
+    std::vector<uint> level(nodes, 0);
+    for(uint node = 0; node < nodes; node++){
+        const uint begin = m_row_begin[node];
+        const uint end = begin + m_row_count[node];
+        float surface = 0;
+        for(uint ee = begin; ee < end; ee++)
+            surface += m_edge_surface[m_entry_edge[ee]];
+        if(m_volume[node] == 0 || surface == 0) continue;
+
+        float stable = 0.5f * std::sqrt(m_volume[node] / (pressure_scale * surface));
+        while(level[node] < max_level && delta / (1u << level[node]) > stable)
+            level[node]++;
+    }
+
+    // Counting sort of the edges by the level of their faster node
+    uint top = 0;
+    auto edge_level = [&](uint edge){ return std::max(level[m_edge_a[edge]], level[m_edge_b[edge]]); };
+    for(uint edge = 0; edge < m_edge_a.size(); edge++)
+        if(m_edge_a[edge] != no_node) top = std::max(top, edge_level(edge));
+
+    m_level_begin.assign(top + 2, 0);
+    for(uint edge = 0; edge < m_edge_a.size(); edge++)
+        if(m_edge_a[edge] != no_node) m_level_begin[edge_level(edge) + 1]++;
+    for(uint ii = 0; ii <= top; ii++) m_level_begin[ii + 1] += m_level_begin[ii];
+
+    auto next = m_level_begin;
+    m_level_edges.resize(m_level_begin.back());
+    m_level_surface.resize(m_level_begin.back());
+    for(uint edge = 0; edge < m_edge_a.size(); edge++){
+        if(m_edge_a[edge] == no_node) continue;
+        uint position = next[edge_level(edge)]++;
+        m_level_edges[position] = edge;
+        m_level_surface[position] = m_edge_surface[edge];
+    }
+
+    m_levels_delta = delta;
+    m_levels_dirty = false;
+}
+
+void GasGraph::apply_fluxes(bool fixed_inflow){
+    // Takes the flow into the first node of each edge from m_flux, and the
+    // new state of the edge from m_flux_acceleration and m_flux_velocity.
+    const uint edges = m_edge_a.size();
+    const uint nodes = m_node_slot.size();
+    m_out_scale.resize(nodes);
+    m_gas_mass_back.resize(nodes);
+
+    const uint block = 1024;
+    const uint blocks = (edges + block - 1)/block;
+
+    // Find how much each node would be giving up, and scale so it
+    // can't give more than it has
+    auto limit = [&](uint node, bool credit){
+        const uint begin = m_row_begin[node];
+        const uint end = begin + m_row_count[node];
+
+        float out_flow = 0;
+        float available = m_gas_mass[node];
+        for(uint ee = begin; ee < end; ee++){
+            uint edge = m_entry_edge[ee];
+            float flow = m_edge_a[edge] == node ? m_flux[edge] : -m_flux[edge];
+            if(flow < 0){
+                out_flow += flow;
+            } else if(credit){
+                uint other = m_entry_target[ee];
+                if(m_solve_fixed[other]) available += flow * m_out_scale[other];
+            }
+        }
+
+        m_out_scale[node] = std::min(1.0f, out_flow >= 0 ? 0 : available/-out_flow);
+    };
+    m_pool.run(nodes, [&](uint first, uint last){
+        for(uint node = first; node < last; node++)
+            if(!fixed_inflow || m_solve_fixed[node])
+                limit(node, false);
+    });
+    // The fixed nodes are limited first, so the others know what they get
+    if(fixed_inflow){
+        m_pool.run(nodes, [&](uint first, uint last){
+            for(uint node = first; node < last; node++)
+                if(!m_solve_fixed[node])
+                    limit(node, true);
+        });
+    }
+
+    // Scale each flow by the limit of the node giving up the gas
+    m_pool.run(blocks, [&](uint first, uint last){
+        uint end = std::min(last * block, edges);
+        for(uint edge = first * block; edge < end; edge++){
+            if(m_edge_a[edge] == no_node) continue;
+            float scale = m_out_scale[m_flux[edge] < 0 ? m_edge_a[edge] : m_edge_b[edge]];
+            m_flux[edge] *= scale;
+            m_edge_acceleration[edge] = m_flux_acceleration[edge] * scale;
+            m_edge_velocity[edge] = m_flux_velocity[edge] * scale;
+        }
+    });
+
+    // Apply the flows to the back buffer
+    m_pool.run(nodes, [&](uint first, uint last){
+        for(uint node = first; node < last; node++){
+            const uint begin = m_row_begin[node];
+            const uint end = begin + m_row_count[node];
+
+            float mass = m_gas_mass[node];
+            for(uint ee = begin; ee < end; ee++){
+                uint edge = m_entry_edge[ee];
+                mass += m_edge_a[edge] == node ? m_flux[edge] : -m_flux[edge];
+            }
+            // A node drained completely can land a rounding error below zero
+            m_gas_mass_back[node] = std::max(0.0f, mass);
+        }
+    });
+
+    m_gas_mass.swap(m_gas_mass_back);
+}
+
+bool GasGraph::moving(uint a, uint b) const {
+    // If either node has no volume or both nodes are nearly empty, then we
+    // can assume nothing interesting is happening here
+    return m_volume[a] != 0 && m_volume[b] != 0
+        && !(m_gas_mass[a] < almost_nothing && m_gas_mass[b] < almost_nothing);
+}
+
+void GasGraph::gather_row(uint node, float * density_a, float * density_b, float * open,
+                          float * surface, float * acceleration, float * velocity) const {
+    const uint begin = m_row_begin[node];
+    const uint count = m_row_count[node];
+    const float density = m_volume[node] != 0 ? this->density(node) : 0;
+
+    for(uint ii = 0; ii < count; ii++){
+        auto other = m_entry_target[begin + ii];
+        auto edge = m_entry_edge[begin + ii];
+        bool open_edge = moving(node, other);
+
+        density_a[ii] = density;
+        density_b[ii] = open_edge ? this->density(other) : 0;
+        open[ii] = open_edge ? 1 : 0;
+
+        // The edge keeps the flow into its first node
+        float side = m_edge_a[edge] == node ? 1 : -1;
+        surface[ii] = m_edge_surface[edge];
+        acceleration[ii] = side * m_edge_acceleration[edge];
+        velocity[ii] = side * m_edge_velocity[edge];
+    }
+}
+
+void GasGraph::step_node(uint node, float delta_time){
+    // If the node has no space or is disconnected we can stop early
+    if(m_volume[node] == 0) return;
+    if(m_row_count[node] == 0) return;
+
+    const uint begin = m_row_begin[node];
+    const uint count = m_row_count[node];
+
+    // We'll calculate these values for each connection with another node,
+    // the space is kept per thread so the parallel modes can use it too
+    thread_local std::vector<float> density_a, density_b, open;
+    thread_local std::vector<float> surface, edge_acceleration, edge_velocity;
+    thread_local std::vector<float> mass_flows, acceleration, velocity;
+    for(auto array : {&density_a, &density_b, &open, &surface, &edge_acceleration,
+                      &edge_velocity, &mass_flows, &acceleration, &velocity})
+        if(array->size() < count) array->resize(count);
+
+    // Use the pressure gradient on each opening to the node to calculate the gas
+    // flow in/out
+    gather_row(node, density_a.data(), density_b.data(), open.data(),
+               surface.data(), edge_acceleration.data(), edge_velocity.data());
+    flux(FluxBatch{
+        density_a.data(), density_b.data(), open.data(),
+        surface.data(), edge_acceleration.data(), edge_velocity.data(),
+        mass_flows.data(), acceleration.data(), velocity.data(),
+        pressure_scale
+    }, count, delta_time);
 
     // Accumulate the total out flow
     float out_flow = 0;
-    for(uint ii = 0; ii < node->edges.size(); ii++){
+    for(uint ii = 0; ii < count; ii++){
         if(mass_flows[ii] <= 0){
             out_flow += mass_flows[ii];
         }
     }
 
     // Get a scale so that the total out flow will at most
-    float out_scale = std::min(1.0f, out_flow >= 0 ? 0 : node->gas_mass/-out_flow);
+    float out_scale = std::min(1.0f, out_flow >= 0 ? 0 : m_gas_mass[node]/-out_flow);
 
     // Apply the transaction
-    for(uint ii = 0; ii < node->edges.size(); ii++){
-        auto& edge = node->edges[ii];
-        auto other = edge.other;
+    for(uint ii = 0; ii < count; ii++){
+        auto other = m_entry_target[begin + ii];
+        auto edge = m_entry_edge[begin + ii];
         float mass_flow;
 
         if(mass_flows[ii] <= 0)
@@ -148,67 +673,731 @@ void GasGraph::step_node(Node* node, float delta_time){
             continue;
 
         if(mass_flow != mass_flow){
-            std::cout << node->gas_mass << " " << mass_flow << " " << other->gas_mass << std::endl;
+            std::cout << m_gas_mass[node] << " " << mass_flow << " " << m_gas_mass[other] << std::endl;
             exit(1);
         }
 
-        mass_flow = std::max(mass_flow, -node->gas_mass);
-        node->gas_mass += mass_flow;
-        other->gas_mass -= mass_flow;
+        mass_flow = std::max(mass_flow, -m_gas_mass[node]);
+        m_gas_mass[node] += mass_flow;
+        m_gas_mass[other] -= mass_flow;
+
+        // Both ends share the edge, store the flow as seen by its first node
+        float side = m_edge_a[edge] == node ? 1 : -1;
+        m_edge_acceleration[edge] = side * acceleration[ii] * out_scale;
+        m_edge_velocity[edge] = side * velocity[ii] * out_scale;
+    }
+}
+
+auto GasGraph::new_node() -> Node {
+    // Reuse a free slot if there is one
+    uint slot;
+    if(m_free_slots.empty()){
+        slot = m_slot_index.size();
+        assert(slot <= slot_mask);
+        m_slot_index.push_back(0);
+        m_slot_generation.push_back(1);
+    } else {
+        slot = m_free_slots.back();
+        m_free_slots.pop_back();
+    }
+
+    m_slot_index[slot] = m_node_slot.size();
+    m_node_slot.push_back(slot);
+
+    m_gas_mass.push_back(0);
+    m_volume.push_back(0);
+    m_surface.push_back(0);
+
+    m_row_begin.push_back(m_entry_edge.size());
+    m_row_count.push_back(0);
+    m_row_capacity.push_back(0);
+
+    m_color.push_back(0);
+
+    m_awake.push_back(1);
+    m_quiet.push_back(0);
+    m_awake_nodes.push_back(m_node_slot.size() - 1);
+    m_levels_dirty = true;
+    return Node{m_slot_generation[slot] << slot_bits | slot};
+}
+
+void GasGraph::remove_node(Node node){
+    // If we can't find the node issue a warning
+    if(!valid(node)){
+        // TODO setup logging with levels
+        debug << "Warning: Tried to free absent node?" << std::endl;
+        return;
+    }
+    uint index = this->index(node);
+
+    // Reservoirs are only listed by slot
+    auto reservoir = std::find(m_reservoir_slots.begin(), m_reservoir_slots.end(), node.id & slot_mask);
+    if(reservoir != m_reservoir_slots.end()){
+        m_reservoir_density.erase(m_reservoir_density.begin() + (reservoir - m_reservoir_slots.begin()));
+        m_reservoir_slots.erase(reservoir);
+    }
+
+    // Disconnect the node from all others, this also wakes it. So its entry
+    // in the awake list is left for whatever node is moved into its place.
+    clear_edges(node);
+    while(m_row_count[index] > 0){
+        wake(m_entry_target[m_row_begin[index] + m_row_count[index] - 1]);
+        remove_edge(m_entry_edge[m_row_begin[index] + m_row_count[index] - 1]);
+    }
+    m_entry_garbage += m_row_capacity[index];
 
-        Edge * other_edge = nullptr;
-        for(auto& temp : other->edges){
-            if(temp.other == node){
-                other_edge = &temp;
-                break;
+    // Move the last node into the space left by this one, the row of edges
+    // stays where it is, but the neighbours need to know where it went.
+    uint last = m_node_slot.size() - 1;
+    if(index != last){
+        m_node_slot[index] = m_node_slot[last];
+        m_slot_index[m_node_slot[index]] = index;
+        m_gas_mass[index] = m_gas_mass[last];
+        m_volume[index] = m_volume[last];
+        m_surface[index] = m_surface[last];
+        m_row_begin[index] = m_row_begin[last];
+        m_row_count[index] = m_row_count[last];
+        m_row_capacity[index] = m_row_capacity[last];
+        m_color[index] = m_color[last];
+        m_awake[index] = m_awake[last];
+        m_quiet[index] = m_quiet[last];
+
+        uint begin = m_row_begin[index];
+        uint end = begin + m_row_count[index];
+        for(uint ee = begin; ee < end; ee++){
+            uint edge = m_entry_edge[ee];
+            if(m_edge_a[edge] == last){
+                m_edge_a[edge] = index;
+                m_entry_target[m_edge_entry_b[edge]] = index;
+            } else {
+                m_edge_b[edge] = index;
+                m_entry_target[m_edge_entry_a[edge]] = index;
             }
         }
+    }
 
-        edge.acceleration = acceleration[ii] * out_scale;
-        other_edge->acceleration = -acceleration[ii] * out_scale;
-        edge.velocity = velocity[ii] * out_scale;
-        other_edge->velocity = -velocity[ii] * out_scale;
+    // Retire the handle, a slot whose generation has run out is never reused
+    uint slot = node.id & slot_mask;
+    if(m_slot_generation[slot] < max_generation){
+        m_slot_generation[slot]++;
+        m_free_slots.push_back(slot);
+    } else {
+        m_slot_generation[slot] = 0;
     }
+    m_node_slot.pop_back();
+    m_gas_mass.pop_back();
+    m_volume.pop_back();
+    m_surface.pop_back();
+    m_row_begin.pop_back();
+    m_row_count.pop_back();
+    m_row_capacity.pop_back();
+    m_color.pop_back();
+    m_awake.pop_back();
+    m_quiet.pop_back();
+    m_levels_dirty = true;
 }
 
-auto GasGraph::new_node() -> Node* {
-    auto node = new Node;
-    m_nodes.push_back(node);
+auto GasGraph::new_reservoir(float density) -> Node {
+    auto node = new_node();
+    m_volume[index(node)] = reservoir_volume;
+    m_reservoir_slots.push_back(node.id & slot_mask);
+    m_reservoir_density.push_back(density);
+    refill_reservoirs();
     return node;
 }
 
-void GasGraph::remove_node(Node * node){
-    // Disconnect the node from all others
-    clear_edges(node);
+bool GasGraph::reservoir(Node node) const {
+    return valid(node) && std::find(m_reservoir_slots.begin(), m_reservoir_slots.end(),
+                                    node.id & slot_mask) != m_reservoir_slots.end();
+}
+
+void GasGraph::set_reservoir_density(Node node, float density){
+    if(!valid(node)) return;
+    auto found = std::find(m_reservoir_slots.begin(), m_reservoir_slots.end(), node.id & slot_mask);
+    if(found == m_reservoir_slots.end()) return;
+    m_reservoir_density[found - m_reservoir_slots.begin()] = density;
+    m_gas_mass[index(node)] = density * reservoir_volume;
+    wake(index(node));
+}
 
-    // Remove the node from the list
-    auto iter = std::find(m_nodes.begin(), m_nodes.end(), node);
+void GasGraph::refill_reservoirs(){
+    for(uint ii = 0; ii < m_reservoir_slots.size(); ii++)
+        m_gas_mass[m_slot_index[m_reservoir_slots[ii]]] = m_reservoir_density[ii] * reservoir_volume;
+}
 
-    if(iter != m_nodes.end()){
-        std::iter_swap(iter, m_nodes.rbegin());
-        m_nodes.pop_back();
+uint GasGraph::add_source(Node node, float rate){
+    uint id;
+    if(m_free_sources.empty()){
+        id = m_source_node.size();
+        m_source_node.emplace_back();
+        m_source_rate.push_back(0);
     } else {
-        // If we can't find the node issue a warning
-        // TODO setup logging with levels
-        debug << "Warning: Tried to free absent node?" << std::endl;
+        id = m_free_sources.back();
+        m_free_sources.pop_back();
     }
+    set_source(id, node, rate);
+    return id;
+}
+
+void GasGraph::set_source(uint id, Node node, float rate){
+    m_source_node[id] = node;
+    m_source_rate[id] = rate;
 }
 
-void GasGraph::set_edge(Node* a, Node* b, float surface){
-    a->edges.push_back({surface, b});
-    b->edges.push_back({surface, a});
+void GasGraph::remove_source(uint id){
+    set_source(id, Node(), 0);
+    m_free_sources.push_back(id);
 }
 
-void GasGraph::clear_edges(Node* a){
-    for(auto edge : a->edges){
-        auto other = edge.other;
-        for(uint ii = 0; ii < other->edges.size(); ii++){
-            if(other->edges[ii].other == a){
-                std::swap(other->edges[ii], other->edges.back());
-                other->edges.pop_back();
-                ii--;
+void GasGraph::apply_sources(float delta){
+    for(uint ii = 0; ii < m_source_node.size(); ii++){
+        auto node = m_source_node[ii];
+        if(m_source_rate[ii] == 0 || !valid(node)) continue;
+        float& mass = m_gas_mass[m_slot_index[node.id & slot_mask]];
+        mass = std::max(0.0f, mass + m_source_rate[ii] * delta);
+    }
+}
+
+void GasGraph::merge_nodes(Node a, Node b){
+    if(a == b || !valid(a) || !valid(b)){
+        debug << "Warning: Tried to merge absent nodes?" << std::endl;
+        return;
+    }
+    if(reservoir(a) || reservoir(b)){
+        debug << "Warning: Tried to merge a reservoir?" << std::endl;
+        return;
+    }
+    uint ia = index(a), ib = index(b);
+    wake(ia);
+
+    // The surface between the two is inside the merged node
+    float inside = 0;
+    uint joining = find_edge(ia, ib);
+    if(joining != no_edge){
+        inside = m_edge_surface[joining];
+        remove_edge(joining);
+    }
+
+    // Move the other edges of b over to a. Where a already has an edge to
+    // the same node they are joined, with the flow averaged by surface.
+    while(m_row_count[ib] > 0){
+        uint edge = m_entry_edge[m_row_begin[ib] + m_row_count[ib] - 1];
+        uint target = m_edge_a[edge] == ib ? m_edge_b[edge] : m_edge_a[edge];
+
+        // Valves keep their own edge, just moved to the other node. One
+        // between the two nodes would be inside the merged node.
+        if(m_edge_valve[edge]){
+            if(target == ia){
+                remove_edge(edge);
+                continue;
+            }
+            bool first = m_edge_a[edge] == ib;
+            remove_entry(ib, first ? m_edge_entry_a[edge] : m_edge_entry_b[edge]);
+            uint position = add_entry(ia, edge, target);
+            if(first){
+                m_edge_a[edge] = ia;
+                m_edge_entry_a[edge] = position;
+                m_entry_target[m_edge_entry_b[edge]] = ia;
+            } else {
+                m_edge_b[edge] = ia;
+                m_edge_entry_b[edge] = position;
+                m_entry_target[m_edge_entry_a[edge]] = ia;
             }
+            wake(target);
+            repair_color(target);
+            continue;
+        }
+        float sign = m_edge_a[edge] == ib ? 1 : -1;
+        float surface = m_edge_surface[edge];
+        float acceleration = sign * m_edge_acceleration[edge];
+        float velocity = sign * m_edge_velocity[edge];
+        remove_edge(edge);
+        wake(target);
+
+        uint existing = find_edge(ia, target);
+        if(existing == no_edge){
+            existing = add_edge(ia, target, surface);
+            m_edge_acceleration[existing] = acceleration;
+            m_edge_velocity[existing] = velocity;
+            repair_color(target);
+        } else {
+            float weight = surface / (surface + m_edge_surface[existing]);
+            sign = m_edge_a[existing] == ia ? 1 : -1;
+            m_edge_acceleration[existing] += weight * (sign * acceleration - m_edge_acceleration[existing]);
+            m_edge_velocity[existing] += weight * (sign * velocity - m_edge_velocity[existing]);
+            m_edge_surface[existing] += surface;
         }
     }
-    a->edges.clear();
+    repair_color(ia);
+
+    m_gas_mass[ia] += m_gas_mass[ib];
+    m_volume[ia] += m_volume[ib];
+    m_surface[ia] += m_surface[ib] - 2 * inside;
+    remove_node(b);
+}
+
+void GasGraph::set_edge(Node a, Node b, float surface){
+    uint ia = index(a), ib = index(b);
+
+    // Update the edge in place if the nodes are already connected
+    wake(ia);
+    wake(ib);
+    uint edge = find_edge(ia, ib);
+    if(edge != no_edge){
+        m_edge_surface[edge] = surface;
+        m_levels_dirty = true;
+        return;
+    }
+
+    add_edge(ia, ib, surface);
+
+    // The new edge brings each node within reach of the other's neighbours
+    repair_color(ia);
+    repair_color(ib);
+}
+
+void GasGraph::clear_edges(Node a){
+    // Work back from the end of the row, removing an entry only moves
+    // the last one, which has already been passed
+    uint index = this->index(a);
+    wake(index);
+    for(uint ii = m_row_count[index]; ii > 0; ii--){
+        uint position = m_row_begin[index] + ii - 1;
+        if(m_edge_valve[m_entry_edge[position]]) continue;
+        wake(m_entry_target[position]);
+        remove_edge(m_entry_edge[position]);
+    }
+}
+
+void GasGraph::clear_edge(Node a, Node b){
+    uint ia = index(a), ib = index(b);
+    uint edge = find_edge(ia, ib);
+    if(edge == no_edge) return;
+
+    wake(ia);
+    wake(ib);
+    remove_edge(edge);
+}
+
+//
+//      Valves
+//
+
+auto GasGraph::add_valve(Node a, Node b, float surface, float openness) -> Valve {
+    uint ia = index(a), ib = index(b);
+    wake(ia);
+    wake(ib);
+
+    uint edge = add_edge(ia, ib, surface * openness);
+    m_edge_valve[edge] = 1;
+    m_edge_full_surface[edge] = surface;
+    m_edge_openness[edge] = openness;
+    repair_color(ia);
+    repair_color(ib);
+    return Valve{edge, m_edge_generation[edge]};
+}
+
+bool GasGraph::valid(Valve valve) const {
+    return valve.edge < m_edge_a.size() && m_edge_generation[valve.edge] == valve.generation
+        && m_edge_a[valve.edge] != no_node && m_edge_valve[valve.edge];
+}
+
+void GasGraph::remove_valve(Valve valve){
+    if(!valid(valve)) return;
+    wake(m_edge_a[valve.edge]);
+    wake(m_edge_b[valve.edge]);
+    remove_edge(valve.edge);
+}
+
+void GasGraph::set_valve_openness(Valve valve, float openness){
+    if(!valid(valve)) return;
+    uint edge = valve.edge;
+    m_edge_openness[edge] = openness;
+    m_edge_surface[edge] = m_edge_full_surface[edge] * openness;
+    wake(m_edge_a[edge]);
+    wake(m_edge_b[edge]);
+    m_levels_dirty = true;
+}
+
+float GasGraph::valve_openness(Valve valve) const {
+    return valid(valve) ? m_edge_openness[valve.edge] : 0;
+}
+
+//
+//      Maintaining the edges and the rows listing them
+//
+
+uint GasGraph::find_edge(uint a, uint b) const {
+    // Search the shorter of the two rows
+    if(m_row_count[b] < m_row_count[a])
+        std::swap(a, b);
+
+    uint begin = m_row_begin[a];
+    uint end = begin + m_row_count[a];
+    for(uint ee = begin; ee < end; ee++){
+        if(m_entry_target[ee] == b && !m_edge_valve[m_entry_edge[ee]])
+            return m_entry_edge[ee];
+    }
+    return no_edge;
+}
+
+uint GasGraph::add_edge(uint a, uint b, float surface){
+    // Reuse a free edge if there is one
+    uint edge;
+    if(m_free_edges.empty()){
+        edge = m_edge_a.size();
+        for(auto array : {&m_edge_a, &m_edge_b, &m_edge_entry_a, &m_edge_entry_b})
+            array->push_back(0);
+        for(auto array : {&m_edge_surface, &m_edge_acceleration, &m_edge_velocity,
+                          &m_edge_full_surface, &m_edge_openness})
+            array->push_back(0);
+        m_edge_valve.push_back(0);
+        m_edge_generation.push_back(1);
+    } else {
+        edge = m_free_edges.back();
+        m_free_edges.pop_back();
+    }
+
+    m_edge_a[edge] = a;
+    m_edge_b[edge] = b;
+    m_edge_surface[edge] = surface;
+    m_edge_acceleration[edge] = 0;
+    m_edge_velocity[edge] = 0;
+    m_edge_entry_a[edge] = add_entry(a, edge, b);
+    m_edge_entry_b[edge] = add_entry(b, edge, a);
+    m_levels_dirty = true;
+    return edge;
+}
+
+void GasGraph::remove_edge(uint edge){
+    remove_entry(m_edge_a[edge], m_edge_entry_a[edge]);
+    remove_entry(m_edge_b[edge], m_edge_entry_b[edge]);
+
+    m_edge_a[edge] = no_node;
+    m_edge_b[edge] = no_node;
+    m_edge_acceleration[edge] = 0;
+    m_edge_velocity[edge] = 0;
+    m_edge_valve[edge] = 0;
+    m_edge_generation[edge]++;
+    m_free_edges.push_back(edge);
+    m_levels_dirty = true;
+}
+
+uint GasGraph::add_entry(uint node, uint edge, uint target){
+    if(m_row_count[node] == m_row_capacity[node])
+        grow_row(node);
+
+    uint position = m_row_begin[node] + m_row_count[node];
+    m_row_count[node]++;
+
+    m_entry_edge[position] = edge;
+    m_entry_target[position] = target;
+    return position;
+}
+
+void GasGraph::remove_entry(uint node, uint position){
+    // Fill the gap with the last entry in the row
+    uint last = m_row_begin[node] + m_row_count[node] - 1;
+    if(position != last){
+        m_entry_edge[position] = m_entry_edge[last];
+        m_entry_target[position] = m_entry_target[last];
+        move_entry(m_entry_edge[position], node, position);
+    }
+    m_row_count[node]--;
+}
+
+void GasGraph::move_entry(uint edge, uint node, uint position){
+    if(m_edge_a[edge] == node)
+        m_edge_entry_a[edge] = position;
+    else
+        m_edge_entry_b[edge] = position;
+}
+
+void GasGraph::grow_row(uint node){
+    // If too much of the table is unused, pack it before growing
+    if(m_entry_garbage > m_entry_edge.size()/2){
+        compact_rows();
+        if(m_row_count[node] < m_row_capacity[node])
+            return;
+    }
+
+    // Move the row to the end of the table with twice the space
+    uint old_begin = m_row_begin[node];
+    uint count = m_row_count[node];
+    uint capacity = std::max(4u, m_row_capacity[node] * 2);
+    uint begin = m_entry_edge.size();
+
+    m_entry_edge.resize(begin + capacity);
+    m_entry_target.resize(begin + capacity);
+    for(uint ii = 0; ii < count; ii++){
+        m_entry_edge[begin + ii] = m_entry_edge[old_begin + ii];
+        m_entry_target[begin + ii] = m_entry_target[old_begin + ii];
+        move_entry(m_entry_edge[begin + ii], node, begin + ii);
+    }
+
+    m_entry_garbage += m_row_capacity[node];
+    m_row_begin[node] = begin;
+    m_row_capacity[node] = capacity;
+}
+
+void GasGraph::compact_rows(){
+    // Lay the rows out again in node order, keeping a little slack in each
+    decltype(m_entry_edge) edges, targets;
+
+    for(uint node = 0; node < m_node_slot.size(); node++){
+        uint old_begin = m_row_begin[node];
+        uint count = m_row_count[node];
+        uint capacity = std::max(4u, count + count/2);
+        uint begin = edges.size();
+
+        edges.resize(begin + capacity);
+        targets.resize(begin + capacity);
+        for(uint ii = 0; ii < count; ii++){
+            edges[begin + ii] = m_entry_edge[old_begin + ii];
+            targets[begin + ii] = m_entry_target[old_begin + ii];
+            move_entry(edges[begin + ii], node, begin + ii);
+        }
+
+        m_row_begin[node] = begin;
+        m_row_capacity[node] = capacity;
+    }
+
+    m_entry_edge.swap(edges);
+    m_entry_target.swap(targets);
+    m_entry_garbage = 0;
+}
+
+//
+//      Colouring the graph
+//
+
+void GasGraph::repair_color(uint node){
+    // Gather the colours of everything within two edges
+    auto& used = m_color_used;
+    used.clear();
+    auto mark = [&](uint other){
+        if(other == node) return;
+        if(m_color[other] >= used.size()) used.resize(m_color[other] + 1);
+        used[m_color[other]] = true;
+    };
+
+    uint begin = m_row_begin[node];
+    uint end = begin + m_row_count[node];
+    for(uint ee = begin; ee < end; ee++){
+        uint other = m_entry_target[ee];
+        mark(other);
+
+        uint other_begin = m_row_begin[other];
+        uint other_end = other_begin + m_row_count[other];
+        for(uint oo = other_begin; oo < other_end; oo++)
+            mark(m_entry_target[oo]);
+    }
+
+    // If there is a conflict take the lowest free colour
+    if(m_color[node] < used.size() && used[m_color[node]])
+        m_color[node] = std::find(used.begin(), used.end(), false) - used.begin();
+}
+
+void GasGraph::update_color_classes(){
+    // Counting sort of the awake nodes by colour
+    uint colors = 0;
+    for(auto node : m_awake_nodes) colors = std::max(colors, m_color[node] + 1);
+
+    m_color_begin.assign(colors + 1, 0);
+    for(auto node : m_awake_nodes) m_color_begin[m_color[node] + 1]++;
+    for(uint ii = 0; ii < colors; ii++) m_color_begin[ii + 1] += m_color_begin[ii];
+
+    auto next = m_color_begin;
+    m_color_nodes.resize(m_awake_nodes.size());
+    for(auto node : m_awake_nodes)
+        m_color_nodes[next[m_color[node]]++] = node;
+}
+
+//
+//      Sleeping nodes
+//
+
+void GasGraph::wake(uint node){
+    m_quiet[node] = 0;
+    if(m_awake[node] == 0){
+        m_awake[node] = 1;
+        m_awake_nodes.push_back(node);
+    }
+}
+
+void GasGraph::wake_all(){
+    m_awake_nodes.resize(m_node_slot.size());
+    for(uint node = 0; node < m_node_slot.size(); node++){
+        m_awake[node] = 1;
+        m_quiet[node] = 0;
+        m_awake_nodes[node] = node;
+    }
+}
+
+void GasGraph::update_sleep(uint node){
+    if(m_sleep_tolerance <= 0) return;
+
+    // The node is quiet if it is close to the pressure of all its neighbours
+    // and nothing is flowing. Neighbours that aren't are woken up, which
+    // only touches the row of this node so is safe in the colored mode.
+    bool quiet = true;
+    const uint begin = m_row_begin[node];
+    const uint end = begin + m_row_count[node];
+    for(uint ee = begin; ee < end; ee++){
+        uint other = m_entry_target[ee];
+        if(!moving(node, other) || m_edge_surface[m_entry_edge[ee]] == 0) continue;
+
+        float difference = std::abs(pressure(other) - pressure(node));
+        if(difference < m_sleep_tolerance && std::abs(m_edge_velocity[m_entry_edge[ee]]) < sleep_velocity)
+            continue;
+
+        quiet = false;
+        if(m_awake[other] == 0)
+            m_awake[other] = 2;
+    }
+
+    m_quiet[node] = quiet ? std::min(m_quiet[node] + 1, 255) : 0;
+    if(m_quiet[node] >= sleep_steps)
+        m_awake[node] = 0;
+}
+
+void GasGraph::collect_awake(){
+    // Nodes woken by a neighbour during the step are marked 2, they can only
+    // be next to a node that was stepped.
+    const uint listed = m_awake_nodes.size();
+    for(uint ii = 0; ii < listed; ii++){
+        uint node = m_awake_nodes[ii];
+        if(m_awake[node] == 2) m_awake[node] = 1;
+    }
+    for(uint ii = 0; ii < listed; ii++){
+        uint node = m_awake_nodes[ii];
+        const uint begin = m_row_begin[node];
+        const uint end = begin + m_row_count[node];
+        for(uint ee = begin; ee < end; ee++){
+            uint other = m_entry_target[ee];
+            if(m_awake[other] == 2){
+                m_awake[other] = 1;
+                m_quiet[other] = 0;
+                m_awake_nodes.push_back(other);
+            }
+        }
+    }
+
+    prune_awake();
+}
+
+void GasGraph::prune_awake(){
+    // Drop nodes that went to sleep. Removing nodes can leave entries past
+    // the end, or a node listed twice (marked 3 while being kept).
+    uint kept = 0;
+    for(auto node : m_awake_nodes){
+        if(node >= m_node_slot.size() || m_awake[node] != 1) continue;
+        m_awake[node] = 3;
+        m_awake_nodes[kept++] = node;
+    }
+    m_awake_nodes.resize(kept);
+    for(auto node : m_awake_nodes) m_awake[node] = 1;
+}
+
+//
+//      Solving for pressure in the implicit mode
+//
+
+void GasGraph::solve_pressure(){
+    // Conjugate gradient, preconditioned with the diagonal of the system
+    const uint nodes = m_node_slot.size();
+    auto& x = m_solve_x;
+    for(auto array : {&m_solve_r, &m_solve_z, &m_solve_p, &m_solve_q})
+        array->resize(nodes);
+    m_solve_partial.resize((nodes + dot_block - 1)/dot_block);
+    auto& r = m_solve_r;
+    auto& z = m_solve_z;
+    auto& p = m_solve_p;
+    auto& q = m_solve_q;
+
+    // Start from the residual of the initial guess
+    multiply_pressure(x, q);
+    m_pool.run(nodes, [&](uint first, uint last){
+        for(uint ii = first; ii < last; ii++){
+            r[ii] = m_solve_rhs[ii] - q[ii];
+            z[ii] = r[ii] / m_solve_diagonal[ii];
+            p[ii] = z[ii];
+        }
+    });
+
+    const double target = solver_tolerance * solver_tolerance * dot(m_solve_rhs, m_solve_rhs);
+    double rz = dot(r, z);
+
+    m_solver_iterations = 0;
+    while(m_solver_iterations < solver_max_iterations && dot(r, r) > target){
+        m_solver_iterations++;
+
+        multiply_pressure(p, q);
+        double pq = dot(p, q);
+        if(pq <= 0) break;
+        double alpha = rz / pq;
+
+        m_pool.run(nodes, [&](uint first, uint last){
+            for(uint ii = first; ii < last; ii++){
+                x[ii] += alpha * p[ii];
+                r[ii] -= alpha * q[ii];
+                z[ii] = r[ii] / m_solve_diagonal[ii];
+            }
+        });
+
+        double rz_next = dot(r, z);
+        double beta = rz_next / rz;
+        rz = rz_next;
+
+        m_pool.run(nodes, [&](uint first, uint last){
+            for(uint ii = first; ii < last; ii++)
+                p[ii] = z[ii] + beta * p[ii];
+        });
+    }
+}
+
+void GasGraph::multiply_pressure(const std::vector<double>& in, std::vector<double>& out){
+    // The diagonal holds the node's own term plus the conductance of all
+    // its edges, the neighbours contribute the off diagonal terms. Rows of
+    // reservoirs only have their diagonal.
+    m_pool.run(m_node_slot.size(), [&](uint first, uint last){
+        for(uint node = first; node < last; node++){
+            double value = m_solve_diagonal[node] * in[node];
+            if(m_solve_fixed[node]){
+                out[node] = value;
+                continue;
+            }
+            const uint begin = m_row_begin[node];
+            const uint end = begin + m_row_count[node];
+            for(uint ee = begin; ee < end; ee++){
+                uint other = m_entry_target[ee];
+                if(!m_solve_fixed[other])
+                    value -= m_conductance[m_entry_edge[ee]] * in[other];
+            }
+            out[node] = value;
+        }
+    });
+}
+
+double GasGraph::dot(const std::vector<double>& a, const std::vector<double>& b){
+    // Sum in fixed blocks and then add the blocks in order, so the
+    // result is the same however many threads there are.
+    const uint block = dot_block;
+    const uint blocks = (a.size() + block - 1)/block;
+    auto& partial = m_solve_partial;
+    partial.resize(blocks);
+
+    m_pool.run(blocks, [&](uint first, uint last){
+        for(uint bb = first; bb < last; bb++){
+            double sum = 0;
+            uint end = std::min<size_t>((bb + 1) * block, a.size());
+            for(uint ii = bb * block; ii < end; ii++)
+                sum += a[ii] * b[ii];
+            partial[bb] = sum;
+        }
+    });
+
+    double sum = 0;
+    for(uint bb = 0; bb < blocks; bb++) sum += partial[bb];
+    return sum;
 }
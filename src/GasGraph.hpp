@@ -9,44 +9,64 @@
 #define HPPB_SRC_GASGRAPH_HPP
 
 #include "definitions.hpp"
+#include "ThreadPool.hpp"
+
+#include <cstdint>
 #include <vector>
 #include <random>
+#include <utility>
 
 /**
  * Manages a very simple network of gas bubbles with gas moving between
  * them. The simulation is not actually based on any physical model.
+ *
+ * Node and edge state is kept in flat parallel arrays so that stepping
+ * the graph streams through memory rather than chasing pointers.
  */
 class GasGraph {
 public:
-    // Forward declaration to resolve dependence.
-    struct Edge;
-
-    // Node in the gas graph
+    // Handle for a node in the gas graph. The state of the node lives in
+    // the arrays of the graph, the handle names a slot in the graph's table
+    // of nodes and the generation of that slot. Once a node is removed its
+    // handles stay invalid, even after the slot is reused.
+    //
+    // A default constructed handle is never valid.
     struct Node {
-        float gas_mass = 0;
+        uint32_t id = 0;
 
-        // Track the size and shape of the node
-        float volume = 0;
-        float surface = 0;
+        bool operator == (Node o) const { return id == o.id; }
+        bool operator != (Node o) const { return id != o.id; }
+    };
 
-        // Track the neighbours of the node
-        std::vector<Edge> edges;
+    // Handle for a valve, an edge whose opening can be scaled without
+    // touching the rest of the graph. A valve is kept apart from any normal
+    // edge between the same nodes and clear_edges leaves it in place, it
+    // only goes with remove_valve or when one of its nodes is removed.
+    //
+    // A default constructed handle is never valid.
+    struct Valve {
+        uint32_t edge = 0;
+        uint32_t generation = 0;
 
-        // Simple method to calculate density of gas in this pocket
-        float density() const;
-        float pressure() const;
+        bool operator == (Valve o) const { return edge == o.edge && generation == o.generation; }
+        bool operator != (Valve o) const { return !(*this == o); }
     };
 
-    // An edge between nodes
-    struct Edge {
-        // How much surface area is shared between the parent of this edge
-        // and the other node
-        float surface;
-        Node * other;
-
-        // TODO Needs to be symetric
-        float acceleration = 0;
-        float velocity = 0;
+    // The ways the graph can be stepped
+    enum class StepMode {
+        // Visit the nodes one at a time in a shuffled order
+        Shuffled,
+        // Visit groups of nodes that don't interact in parallel
+        Colored,
+        // Calculate all the flows from the state at the start of the step,
+        // then apply them. Deterministic regardless of thread count.
+        Jacobi,
+        // Solve for the pressures at the end of the step (backward Euler).
+        // Stable for large steps, gas diffuses rather than sloshing around.
+        Implicit,
+        // Like Jacobi, but edges between small nodes take several smaller
+        // steps while the rest of the graph takes one.
+        Multirate,
     };
 
 public:
@@ -57,32 +77,315 @@ public:
 public:
     // Allow gas pressure to equalize between connected nodes
     void step(float delta);
+    // Take several steps in a row, the same as calling step that many
+    // times but only preparing once
+    void step_n(float delta, uint count);
+
+    // Select how the graph is stepped
+    void set_mode(StepMode);
+    StepMode mode() const;
+    // Set how many threads the parallel modes can use
+    void set_threads(uint);
+    // Iterations the pressure solve took in the last implicit step
+    uint solver_iterations() const;
+    // Substeps the fastest edges took in the last multirate step
+    uint substeps() const;
+
+    // Let nodes sleep once their pressure is within a tolerance of all
+    // their neighbours and nothing is flowing, zero keeps every node awake.
+    // Sleeping nodes are skipped by the Shuffled and Colored modes, the
+    // other modes always step every node.
+    void set_sleep_tolerance(float);
+    // Wake a node up so it is stepped again. Nodes are also woken when
+    // their state or edges are changed, or a neighbour disturbs them.
+    void wake(Node);
+    bool awake(Node) const;
+    // The number of nodes currently awake
+    uint awake_count() const;
 
 protected:
+    // Step using each of the modes, once step_n has prepared the graph
+    void step_shuffled(float delta);
+    void step_colored(float delta);
+    void step_jacobi(float delta);
+    void step_implicit(float delta);
+    void step_multirate(float delta);
+
+    // Limit the per edge flows in m_flux so no node gives more than it has,
+    // then apply them and the new edge state. If asked, gas coming from the
+    // nodes marked in m_solve_fixed counts toward what a node has.
+    void apply_fluxes(bool fixed_inflow = false);
+
+    // Solve the implicit pressure system, starting from m_solve_x
+    void solve_pressure();
+    // Multiply a vector by the implicit pressure system
+    void multiply_pressure(const std::vector<double>&, std::vector<double>&);
+    // Dot product, summed in the same order for any number of threads
+    double dot(const std::vector<double>&, const std::vector<double>&);
+
+    // Sort the edges by how many substeps they need at a time step
+    void update_levels(float delta);
+    // Limit and apply the flows of a range of the sorted edges
+    void apply_level_fluxes(uint, uint);
+
+    // Write out the inputs of the flux kernel for the edges in a node's row:
+    // the densities on either side, whether gas can move, and the state of
+    // the edge as seen from the node.
+    void gather_row(uint, float*, float*, float*, float*, float*, float*) const;
+
+    // Check if gas can move between two nodes
+    bool moving(uint, uint) const;
+
     // Perform the equalization step for one node
-    void step_node(Node*, float delta);
+    void step_node(uint, float delta);
+
+    // Put every reservoir back to its fixed density
+    void refill_reservoirs();
+    // Add the gas from every source over a time step
+    void apply_sources(float delta);
 
 public:
     // Create a new node
-    Node * new_node();
+    Node new_node();
+    // Check if a handle refers to a node that still exists
+    bool valid(Node) const;
     // Remove a node from the graph
-    void remove_node(Node*);
-    // Merge two nodes into a single one.
-    void merge_nodes(Node*, Node*);
+    void remove_node(Node);
+    // Merge two nodes into a single one, neither can be a reservoir.
+    void merge_nodes(Node, Node);
+
+    // Create a reservoir, a node that holds its gas at a fixed density no
+    // matter how much flows in or out of it. Zero density is a vacuum.
+    // Reservoirs are stepped like any other node, but their volume is set
+    // so large that no flow limit applies, and they are refilled after
+    // every step. Their volume and mass shouldn't be set directly.
+    Node new_reservoir(float density);
+    bool reservoir(Node) const;
+    void set_reservoir_density(Node, float);
+
+    // Register a source adding gas to a node at a rate in mass per second,
+    // or a sink for negative rates. Sinks never take more than the node
+    // has. All of the sources are applied in one pass before each step, a
+    // source whose node is removed does nothing until it is moved.
+    uint add_source(Node, float rate);
+    void set_source(uint, Node, float rate);
+    void remove_source(uint);
 
     // Set the surface area connecting two nodes
-    void set_edge(Node*, Node*, float);
+    void set_edge(Node, Node, float);
 
     // Remove all of the edges connecting a node to its neighbours
-    void clear_edges(Node*);
+    void clear_edges(Node);
 
     // Remove a connection between nodes
-    void clear_edge(Node*, Node*);
+    void clear_edge(Node, Node);
+
+    // Connect two nodes through a valve with the given surface when fully
+    // open, and how open it starts (0 closed to 1 fully open)
+    Valve add_valve(Node, Node, float surface, float openness);
+    bool valid(Valve) const;
+    void remove_valve(Valve);
+    // Change how open a valve is, in constant time
+    void set_valve_openness(Valve, float);
+    float valve_openness(Valve) const;
+
+public:
+    // Read and write the state of a node
+    float gas_mass(Node) const;
+    void set_gas_mass(Node, float);
+    float volume(Node) const;
+    void set_volume(Node, float);
+    float surface(Node) const;
+    void set_surface(Node, float);
+
+    // Simple method to calculate density of gas in a node
+    float density(Node) const;
+    float pressure(Node) const;
+
+    // List the neighbours of a node with the surface connecting them,
+    // not counting valves
+    std::vector<std::pair<Node, float>> neighbours(Node) const;
 
 protected:
-    std::vector<Node*> m_nodes;
+    // Find the index of a node in the node arrays
+    uint index(Node) const;
+
+    // Calculate the density/pressure of a node by index
+    float density(uint) const;
+    float pressure(uint) const;
+
+    // Find the normal edge between two nodes, or no_edge
+    uint find_edge(uint, uint) const;
+    // Connect two nodes, returning the new edge
+    uint add_edge(uint, uint, float);
+    // Disconnect the two nodes joined by an edge
+    void remove_edge(uint);
+
+    // Add an entry to the row of a node, returning its position
+    uint add_entry(uint, uint edge, uint target);
+    // Remove the entry at a position in a node's row
+    void remove_entry(uint, uint);
+    // Tell an edge where its entry in a node's row has moved to
+    void move_entry(uint edge, uint node, uint position);
+    // Give a node's row room for at least one more entry
+    void grow_row(uint);
+    // Rebuild the row arrays without any unused space between rows
+    void compact_rows();
+
+    // Make sure no node within two edges of this one shares its colour
+    void repair_color(uint);
+    // Sort the awake nodes into groups by colour
+    void update_color_classes();
+
+    // Add a node to the awake list
+    void wake(uint);
+    void wake_all();
+    // Check if a node just stepped can sleep, marking disturbed neighbours
+    void update_sleep(uint);
+    // Rebuild the awake list at the end of a step
+    void collect_awake();
+    // Clean up the awake list after nodes sleep or are removed
+    void prune_awake();
+
+protected:
+    // Handles are split into a slot and the generation of that slot
+    static constexpr uint slot_bits = 20;
+    static constexpr uint32_t slot_mask = (1u << slot_bits) - 1;
+    static constexpr uint32_t max_generation = (1u << (32 - slot_bits)) - 1;
+
+    // The table of slots, for each slot where its node is in the node arrays
+    // and how many times the slot has been used.
+    std::vector<uint> m_slot_index;
+    std::vector<uint32_t> m_slot_generation;
+    std::vector<uint> m_free_slots;
+
+    // Slot of each node, the position in this list is the index of the node
+    // in all of the arrays below.
+    std::vector<uint> m_node_slot;
+
+    // Node state
+    std::vector<float> m_gas_mass;
+    std::vector<float> m_volume;
+    std::vector<float> m_surface;
+
+    // The edges of each node are listed in a contiguous run (row) of the
+    // entry arrays. Rows have some spare capacity so most edits happen in
+    // place, rows that outgrow their space are moved to the end.
+    std::vector<uint> m_row_begin;
+    std::vector<uint> m_row_count;
+    std::vector<uint> m_row_capacity;
+    // For each entry, the edge and the node on the other end of it
+    std::vector<uint> m_entry_edge;
+    std::vector<uint> m_entry_target;
+    // How many entries are not in any row
+    uint m_entry_garbage = 0;
+
+    // Each connection between nodes 'a' and 'b' is a single edge. Its
+    // acceleration and velocity are of the flow into 'a', and it knows
+    // where it is listed in both rows. Removed edges have no nodes and
+    // are kept on a free list until reused.
+    std::vector<uint> m_edge_a;
+    std::vector<uint> m_edge_b;
+    std::vector<uint> m_edge_entry_a;
+    std::vector<uint> m_edge_entry_b;
+    std::vector<float> m_edge_surface;
+    std::vector<float> m_edge_acceleration;
+    std::vector<float> m_edge_velocity;
+    std::vector<uint> m_free_edges;
+
+    // Valves are edges whose surface is their full surface scaled by how
+    // open they are. The generation of an edge changes each time it is
+    // removed, so old valve handles can be told apart.
+    std::vector<uint8_t> m_edge_valve;
+    std::vector<float> m_edge_full_surface;
+    std::vector<float> m_edge_openness;
+    std::vector<uint32_t> m_edge_generation;
+
+    // The slots of the reservoir nodes, with the density each is held at
+    std::vector<uint> m_reservoir_slots;
+    std::vector<float> m_reservoir_density;
+    const float reservoir_volume = 1e6;
+
+    // Sources by id, unused ones have a rate of zero and no node
+    std::vector<Node> m_source_node;
+    std::vector<float> m_source_rate;
+    std::vector<uint> m_free_sources;
+
+    // Nodes are coloured so that no two nodes within two edges of each
+    // other share a colour. Stepping a node only touches it and its direct
+    // neighbours, so every node of a colour can be stepped at once.
+    std::vector<uint> m_color;
+    // Working space for the Shuffled mode, the nodes still to be stepped
+    // and the last round each node was blocked from being stepped in
+    std::vector<uint> m_remaining;
+    std::vector<uint> m_blocked;
+    uint m_round = 0;
+
+    // The awake nodes grouped by colour, each colour is a contiguous range
+    std::vector<uint> m_color_nodes;
+    std::vector<uint> m_color_begin;
+    // Working space for shuffling the colours and for repairing a colour
+    std::vector<uint> m_color_order;
+    std::vector<bool> m_color_used;
+
+    // For each node whether it is awake (0 asleep, 1 awake, 2 woken during
+    // the current step), and how many steps it has been quiet for. The
+    // awake nodes are also kept in a list so stepping doesn't have to look
+    // at the sleeping ones.
+    std::vector<uint8_t> m_awake;
+    std::vector<uint8_t> m_quiet;
+    std::vector<uint> m_awake_nodes;
+    float m_sleep_tolerance = 0;
+    const float sleep_velocity = 1e-3;
+    const uint sleep_steps = 8;
+
+    // Working space for the Jacobi mode, the fluxes are per edge and the
+    // gas mass is written to a back buffer then swapped to the front.
+    std::vector<float> m_density_a;
+    std::vector<float> m_density_b;
+    std::vector<float> m_open;
+    std::vector<float> m_flux;
+    std::vector<float> m_flux_acceleration;
+    std::vector<float> m_flux_velocity;
+    std::vector<float> m_out_scale;
+    std::vector<float> m_gas_mass_back;
+
+    // Working space for the implicit mode. The conductance of each edge
+    // already includes the time step. The system is solved in doubles,
+    // its diagonal is also used as the preconditioner. Reservoirs are
+    // marked as fixed, their row just holds their pressure.
+    std::vector<float> m_conductance;
+    std::vector<uint8_t> m_solve_fixed;
+    std::vector<double> m_solve_diagonal;
+    std::vector<double> m_solve_rhs;
+    std::vector<double> m_solve_x;
+    std::vector<double> m_solve_r;
+    std::vector<double> m_solve_z;
+    std::vector<double> m_solve_p;
+    std::vector<double> m_solve_q;
+    // Per block sums for dot, so it gives the same result on any thread count
+    std::vector<double> m_solve_partial;
+    uint m_solver_iterations = 0;
+    const double solver_tolerance = 1e-6;
+    const uint solver_max_iterations = 200;
+    const uint dot_block = 1024;
+
+    // The edges for the multirate mode sorted by level, an edge of level L
+    // takes 2^L substeps. The surface of each edge is copied alongside.
+    std::vector<uint> m_level_edges;
+    std::vector<float> m_level_surface;
+    std::vector<uint> m_level_begin;
+    float m_levels_delta = 0;
+    bool m_levels_dirty = true;
+    uint m_substeps = 1;
+    const uint max_level = 10;
+
+    static constexpr uint no_edge = uint(-1);
+    static constexpr uint no_node = uint(-1);
     const float almost_nothing = 1e-4;
     std::mt19937 m_prng;
+    StepMode m_mode = StepMode::Shuffled;
+    ThreadPool m_pool;
 
 };
 
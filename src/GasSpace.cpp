@@ -9,13 +9,28 @@
 #include "score.hpp"
 #include "Cluster.hpp"
 
+#include <algorithm>
 #include <limits>
+#include <cassert>
+#include <chrono>
+#include <unordered_map>
 #include <unordered_set>
 #include <sstream>
 #include <iostream>
 
 auto& debug = std::cout;
 
+namespace {
+    // Keys in the part lookup, the sector id above the part's position
+    uint64_t part_key(uint32_t id, uint index){
+        return uint64_t(id) << 32 | index;
+    }
+
+    uint key_index(uint64_t key){
+        return uint(key & 0xffffffff);
+    }
+}
+
 //
 //      Sector operations
 //
@@ -47,16 +62,141 @@ void GasSpace::step(float delta){
     m_graph.step(delta);
 }
 
+void GasSpace::step_n(float delta, uint count){
+    m_graph.step_n(delta, count);
+}
+
+void GasSpace::set_sleep_tolerance(float tolerance){
+    m_graph.set_sleep_tolerance(tolerance);
+}
+
 void GasSpace::block(Volume volume){
     debug << "Blocking volume " << volume << std::endl;
-    std::unordered_set<Sector*> changed_sectors;
+    m_edits.push_back(Edit{volume, true});
+    if(m_edit_depth == 0) apply_edits();
+}
+
+void GasSpace::clear(Volume volume){
+    debug << "Clearing volume " << volume << std::endl;
+    m_edits.push_back(Edit{volume, false});
+    if(m_edit_depth == 0) apply_edits();
+}
+
+void GasSpace::begin_edit(){
+    m_edit_depth++;
+}
+
+void GasSpace::commit(){
+    assert(m_edit_depth > 0);
+    if(--m_edit_depth == 0) apply_edits();
+}
+
+//
+//      Applying edits
+//
+
+void GasSpace::apply_edits(){
+    if(m_edits.empty()) return;
+
+    // Where edits overlap the later one wins, so work backwards taking
+    // out the space already claimed by later edits.
+    std::vector<Volume> blocked, cleared, claimed;
+    for(auto edit = m_edits.rbegin(); edit != m_edits.rend(); edit++){
+        Cluster piece{edit->volume};
+        for(auto taken : claimed){
+            if(piece.empty()) break;
+            piece = piece - taken;
+        }
+        claimed.push_back(edit->volume);
+
+        for(auto part : piece)
+            (edit->blocked ? blocked : cleared).push_back(part);
+    }
+    m_edits.clear();
+
+    Cluster to_block(blocked), to_clear(cleared);
+    to_block.compact();
+    to_clear.compact();
+
+    // Change the sectors, but only work out their adjacency once all the
+    // changes are in, then check the blocked ones for partitioning.
+    m_deferring = true;
+    auto changed_sectors = block_cluster(to_block);
+    for(auto part : to_clear)
+        clear_volume(part);
+    m_deferring = false;
+
+    for(auto sector : m_dirty_list){
+        if(m_dirty.erase(sector))
+            update_adjacency(sector);
+    }
+    m_dirty_list.clear();
+
+    for(auto sector : changed_sectors)
+        partition_sector(sector);
+    m_score_cache.clear();
+    resolve_doors();
+    resolve_exposures();
+    resolve_sources();
+}
+
+auto GasSpace::block_cluster(const Cluster& volume) -> std::vector<Sector*> {
+    std::vector<Sector*> changed_sectors;
+    if(volume.empty()) return changed_sectors;
+
+    if(m_voxels)
+        for(auto part : volume)
+            m_voxels->fill(part, 0);
+
+    // Find every sector touched by any of the volume
+    std::vector<Sector*> affected;
+    std::unordered_set<Sector*> seen;
+    for(auto part : volume)
+        for(auto sector : overlapping_sectors(part))
+            if(seen.insert(sector).second)
+                affected.push_back(sector);
+
+    // Work out what each sector loses before changing any of them
+    std::vector<Cluster> lost;
+    std::unordered_map<Sector*, uint> position;
+    for(auto sector : affected){
+        std::vector<Volume> pieces;
+        for(auto part : volume)
+            for(auto piece : sector->parts & part)
+                pieces.push_back(piece);
+        position[sector] = lost.size();
+        lost.emplace_back(pieces);
+    }
+
+    // Blocking can only take away contact. For a pair of sectors that both
+    // lost space, the contact between the lost pieces was taken away twice.
+    std::vector<std::tuple<Sector*, Sector*, float>> contact_changes;
+    for(uint ii = 0; ii < affected.size(); ii++){
+        auto sector = affected[ii];
+        for(auto portal : sector->portals){
+            auto other = portal.first;
+            auto found = position.find(other);
+            if(found == position.end()){
+                contact_changes.emplace_back(sector, other, -lost[ii].contact(other->parts));
+            } else if(sector->id < other->id){
+                auto& other_lost = lost[found->second];
+                contact_changes.emplace_back(sector, other, lost[ii].contact(other_lost)
+                    - lost[ii].contact(other->parts) - sector->parts.contact(other_lost));
+            }
+        }
+    }
 
-    // Modify effected sectors
-    for(auto sector : affected_sectors(volume)){
-        auto new_parts = sector->parts - volume;
+    // Modify effected sectors, each one only once
+    std::unordered_set<Sector*> removed;
+    for(auto sector : affected){
+        auto new_parts = sector->parts;
+        for(auto part : volume)
+            if(new_parts.overlap(part))
+                new_parts = new_parts - part;
 
         if(new_parts.volume() == 0){
             debug << "Removing Sector " << sector << std::endl;
+            removed.insert(sector);
             remove_sector(sector);
         } else if(sector->parts != new_parts){
             debug << "Blocking sector" << std::endl;
@@ -65,23 +205,32 @@ void GasSpace::block(Volume volume){
             for(auto part : new_parts)
                 debug << "+\t" << part << std::endl;
             sector->parts = new_parts;
-            changed_sectors.insert(sector);
+            changed_sectors.push_back(sector);
             sector->parts.compact();
             update_node(sector);
-            update_adjacency(sector);
         }
     }
 
-    // Check for partition
-    for(auto sector : changed_sectors){
-        partition_sector(sector);
+    for(auto change : contact_changes){
+        if(removed.count(std::get<0>(change)) || removed.count(std::get<1>(change))) continue;
+        add_contact(std::get<0>(change), std::get<1>(change), std::get<2>(change));
     }
+    return changed_sectors;
 }
 
-void GasSpace::clear(Volume volume){
-    debug << "Clearing volume " << volume << std::endl;
+void GasSpace::clear_volume(Volume volume){
+    // Space that is already open stays with the sector that has it, only
+    // the rest needs a home. Otherwise a sector that scores the addition
+    // highly could take space another sector already holds.
+    Cluster fresh{volume};
+    for(auto sector : overlapping_sectors(volume))
+        for(auto part : sector->parts)
+            if(part.overlap(volume))
+                fresh = fresh - part;
+    if(!fresh.empty()) m_opened++;
+
     // We may break the volume into parts and give it to multiple sectors
-    std::vector<Volume> parts{volume};
+    std::vector<Volume> parts = fresh.parts();
     std::vector<Volume> poor_fits;
 
     // Let sectors take parts of the volume
@@ -149,7 +298,15 @@ void GasSpace::clear(Volume volume){
 float GasSpace::air_at(Point point) const {
     auto sector = find_sector(point);
     if(sector){
-        return sector->node->density();
+        return m_graph.density(sector->node);
+    }
+    return 0;
+}
+
+float GasSpace::pressure_at(Point point) const {
+    auto sector = find_sector(point);
+    if(sector){
+        return m_graph.pressure(sector->node);
     }
     return 0;
 }
@@ -157,10 +314,36 @@ float GasSpace::air_at(Point point) const {
 void GasSpace::add_air(Point point, float value){
     auto sector = find_sector(point);
     if(sector){
-        sector->node->gas_mass += value;
+        m_graph.set_gas_mass(sector->node, m_graph.gas_mass(sector->node) + value);
     }
 }
 
+void GasSpace::air_at(const Point* points, size_t count, float* out) const {
+    std::vector<Sector*> sectors(count);
+    find_sectors(points, count, sectors.data());
+    for(size_t ii = 0; ii < count; ii++)
+        out[ii] = sectors[ii] ? m_graph.density(sectors[ii]->node) : 0;
+}
+
+void GasSpace::pressure_at(const Point* points, size_t count, float* out) const {
+    std::vector<Sector*> sectors(count);
+    find_sectors(points, count, sectors.data());
+    for(size_t ii = 0; ii < count; ii++)
+        out[ii] = sectors[ii] ? m_graph.pressure(sectors[ii]->node) : 0;
+}
+
+void GasSpace::add_air(const Point* points, const float* values, size_t count){
+    std::vector<Sector*> sectors(count);
+    find_sectors(points, count, sectors.data());
+
+    // Total up the gas for each sector, then touch each node once
+    std::unordered_map<Sector*, float> totals;
+    for(size_t ii = 0; ii < count; ii++)
+        if(sectors[ii]) totals[sectors[ii]] += values[ii];
+    for(auto total : totals)
+        m_graph.set_gas_mass(total.first->node, m_graph.gas_mass(total.first->node) + total.second);
+}
+
 //
 //
 //
@@ -175,67 +358,127 @@ std::string GasSpace::describe() const {
     ss << "Size: " << size() << std::endl;
 
     for(auto sector : m_sector_list){
-        ss << "Node " << sector->node << std::endl;
+        ss << "Node " << sector->node.id << std::endl;
         ss << "Parts " << sector->parts.size() << std::endl;
         for(auto part : sector->parts)
             ss << "\t" << part << std::endl;
-        ss << "Neighbours " << sector->node->edges.size() << std::endl;
-        for(auto edge : sector->node->edges)
-            ss << "\t" << edge.other << "\t" << edge.surface << std::endl;
+        auto neighbours = m_graph.neighbours(sector->node);
+        ss << "Neighbours " << neighbours.size() << std::endl;
+        for(auto edge : neighbours)
+            ss << "\t" << edge.first.id << "\t" << edge.second << std::endl;
         ss << std::endl;
     }
 
     return ss.str();
 }
 
+auto GasSpace::layout() const -> Layout {
+    Layout out;
+    std::unordered_map<uint32_t, uint> position;
+    for(auto sector : m_sector_list){
+        position[sector->node.id] = out.sectors.size();
+        out.sectors.push_back(sector->parts);
+    }
+
+    // Each edge is seen from both ends, keep it once
+    for(auto sector : m_sector_list){
+        uint index = position[sector->node.id];
+        for(auto edge : m_graph.neighbours(sector->node)){
+            uint other = position[edge.first.id];
+            if(index < other)
+                out.edges.emplace_back(index, other, edge.second);
+        }
+    }
+    return out;
+}
+
 //
 //      Methods for finding sectors
 //
 // Currently brute force, can later be replaced by fast lookup
 
 auto GasSpace::find_sector(Point point) const -> Sector* {
-    auto result = m_sector_lookup.intersecting(point);
+    if(m_voxels)
+        return m_sector_ids[m_voxels->get(point)];
+
+    auto result = m_part_lookup.intersecting(point);
     if(result.size() > 0)
-        return result.front();
+        return key_sector(result.front());
     return nullptr;
 }
 
+void GasSpace::find_sectors(const Point* points, size_t count, Sector** out) const {
+    // Interleave the bits of the coordinates (offset to be positive) and
+    // sort on that, so points close in space are close in the list
+    auto spread = [](int value){
+        uint64_t bits = uint64_t(value + (1 << 20)) & ((1 << 21) - 1);
+        bits = (bits | bits << 32) & 0x1f00000000ffffull;
+        bits = (bits | bits << 16) & 0x1f0000ff0000ffull;
+        bits = (bits | bits << 8) & 0x100f00f00f00f00full;
+        bits = (bits | bits << 4) & 0x10c30c30c30c30c3ull;
+        bits = (bits | bits << 2) & 0x1249249249249249ull;
+        return bits;
+    };
+    std::vector<std::pair<uint64_t, uint32_t>> order(count);
+    for(size_t ii = 0; ii < count; ii++)
+        order[ii] = {spread(points[ii].x) << 2 | spread(points[ii].y) << 1 | spread(points[ii].z), ii};
+    std::sort(order.begin(), order.end());
+
+    std::vector<Point> sorted(count);
+    for(size_t ii = 0; ii < count; ii++)
+        sorted[ii] = points[order[ii].second];
+
+    if(m_voxels){
+        std::vector<uint32_t> ids(count);
+        m_voxels->get(sorted.data(), count, ids.data());
+        for(size_t ii = 0; ii < count; ii++)
+            out[order[ii].second] = m_sector_ids[ids[ii]];
+        return;
+    }
+
+    // Consecutive points usually land in the same sector, try it first
+    Sector* last = nullptr;
+    for(size_t ii = 0; ii < count; ii++){
+        auto point = sorted[ii];
+        if(!last || !last->parts.overlap(Volume(point)))
+            last = find_sector(point);
+        out[order[ii].second] = last;
+    }
+}
+
 std::vector<GasSpace::Sector*> GasSpace::overlapping_sectors(Volume test) const{
-    return m_sector_lookup.intersecting(test);
+    std::vector<Sector*> out;
+    std::unordered_set<Sector*> seen;
+    for(auto key : m_part_lookup.intersecting(test)){
+        auto sector = key_sector(key);
+        if(seen.insert(sector).second)
+            out.push_back(sector);
+    }
+    return out;
 }
 
 std::vector<GasSpace::Sector*> GasSpace::adjacent_sectors(Volume test) const{
     std::vector<Sector*> out;
-    for(auto sector : m_sector_lookup.intersecting(test.grow(1))){
-        bool adjacent = false;
-        for(auto part : sector->parts){
-            if(part.adjacent(test)){
-                adjacent = true;
-                break;
-            }
-        }
-        if(adjacent)
+    std::unordered_set<Sector*> seen;
+    for(auto key : m_part_lookup.intersecting(test.grow(1))){
+        auto sector = key_sector(key);
+        if(sector->parts[key_index(key)].adjacent(test) && seen.insert(sector).second)
             out.push_back(sector);
     }
     return out;
 }
 
 std::vector<GasSpace::Sector*> GasSpace::adjacent_sectors(Sector* input) const{
-    std::unordered_set<Sector*> out;
+    std::vector<Sector*> out;
+    std::unordered_set<Sector*> seen;
     for(auto test : input->parts){
-        for(auto sector : m_sector_lookup.intersecting(test.grow(1))){
-            bool overlap = false;
-            for(auto part : sector->parts){
-                if(part.adjacent(test)){
-                    overlap = true;
-                    break;
-                }
-            }
-            if(overlap)
-                out.insert(sector);
+        for(auto key : m_part_lookup.intersecting(test.grow(1))){
+            auto sector = key_sector(key);
+            if(sector->parts[key_index(key)].adjacent(test) && seen.insert(sector).second)
+                out.push_back(sector);
         }
     }
-    return std::vector<Sector*>(out.begin(), out.end());
+    return out;
 }
 
 auto GasSpace::affected_sectors(Volume volume) const -> std::vector<Sector*>{
@@ -255,15 +498,17 @@ GasSpace::Sector* GasSpace::create_sector(Volume space){
     // Allocate memory
     auto sector = new Sector;
     sector->node = m_graph.new_node();
-    sector->node->volume = space.volume();
-    sector->node->surface = space.surface();
+    m_graph.set_volume(sector->node, space.volume());
+    m_graph.set_surface(sector->node, space.surface());
 
     // Assign parts
     sector->parts = {space};
+    sector->version = ++m_last_version;
 
     // put in place
+    assign_id(sector);
     m_sector_list.push_back(sector);
-    m_sector_lookup.insert(sector, sector->bounds());
+    index_parts(sector);
     update_adjacency(sector);
     return sector;
 }
@@ -275,8 +520,8 @@ GasSpace::Sector* GasSpace::create_sector(const Cluster& space){
     sector->parts = space;
 
     // put in place
+    assign_id(sector);
     m_sector_list.push_back(sector);
-    m_sector_lookup.insert(sector, sector->bounds());
     update_node(sector);
     update_adjacency(sector);
     return sector;
@@ -290,20 +535,44 @@ void GasSpace::remove_sector(Sector* sector){
             m_sector_list.pop_back();
         }
     }
-    m_sector_lookup.remove(sector);
-
-    // Update the graph
-    m_graph.remove_node(sector->node);
+    unindex_parts(sector);
+    m_dirty.erase(sector);
+    m_partition_pending.erase(sector);
+    m_sector_ids[sector->id] = nullptr;
+    m_free_ids.push_back(sector->id);
+    for(auto portal : sector->portals)
+        portal.first->portals.erase(sector);
+
+    // Update the graph, unless the node was already merged away
+    if(m_graph.valid(sector->node))
+        m_graph.remove_node(sector->node);
+    delete sector;
 }
 
 void GasSpace::expand(Sector* sector, Volume space){
+    // Only take the space that is new to the sector, adding a copy of a
+    // part it already has would let compact stretch it. The new space is
+    // also all that changes its contacts.
+    Cluster added{space};
+    if(sector->parts.overlap(space))
+        for(auto part : sector->parts)
+            added = added - part;
+    if(added.empty()) return;
+
     //
-    sector->parts.add(space);
+    for(auto piece : added)
+        sector->parts.add(piece);
     sector->parts.compact();
+    if(m_voxels) m_voxels->fill(space, sector->id);
 
     // Update all the aux data
     update_node(sector);
-    update_adjacency(sector);
+    for(auto piece : added){
+        for(auto other : adjacent_sectors(piece)){
+            if(other == sector) continue;
+            add_contact(sector, other, other->parts.contact(piece));
+        }
+    }
 }
 
 // There are two grounds for partitioning a sector:
@@ -319,14 +588,14 @@ void GasSpace::partition_sector(Sector* sector) {
     auto components = sector->parts.connected_components();
     std::cout << "PARTS " << sector->parts.size() << " " << components.size() << std::endl;
     if(components.size() > 1){
-        float old_density = sector->node->density();
+        float old_density = m_graph.density(sector->node);
 
         // Reset the base sector
         sector->parts = components.back();
         components.pop_back();
         update_node(sector);
         update_adjacency(sector);
-        sector->node->gas_mass = old_density * sector->node->volume;
+        m_graph.set_gas_mass(sector->node, old_density * m_graph.volume(sector->node));
 
         // Fill in new components
         std::vector<Sector*> new_sectors = {sector};
@@ -334,7 +603,7 @@ void GasSpace::partition_sector(Sector* sector) {
             std::cout << "Subsection" << std::endl;
             auto new_sector = create_sector(sub_section);
             new_sectors.push_back(new_sector);
-            new_sector->node->gas_mass = old_density * new_sector->node->volume;
+            m_graph.set_gas_mass(new_sector->node, old_density * m_graph.volume(new_sector->node));
         }
 
         for(auto sector : new_sectors)
@@ -342,58 +611,501 @@ void GasSpace::partition_sector(Sector* sector) {
         return;
     }
 
-    // Check for the second condition
-    Split split = ::score(sector->parts.parts());
-    if(split.score < score_threshold){
-        auto bounds = sector->parts.bounds();
-        auto half_one = bounds;
-        half_one.size[split.axis] = split.index - half_one.offset[split.axis];
-
-        auto half_two = bounds;
-        half_two.size[split.axis] = bounds.size[split.axis] - half_one.size[split.axis];
-        half_two.offset[split.axis] = split.index;
-
-        //
-        auto shape_one = sector->parts & half_one;
-        auto shape_two = sector->parts & half_two;
-        shape_one.compact();
-        shape_two.compact();
-
-        // Reset old sector
-        sector->parts = shape_one;
-        update_node(sector);
-        update_adjacency(sector);
-
-        // Create new one
-        auto new_sector = create_sector(shape_two);
+    // The second condition can wait for maintain
+    if(m_lazy_partition){
+        if(m_partition_pending.insert(sector).second)
+            m_partition_queue.push_back(sector);
+        return;
+    }
 
-        // Recurse
+    // Recurse
+    auto new_sector = split_sector(sector);
+    if(new_sector){
         partition_sector(sector);
         partition_sector(new_sector);
     }
 }
 
+auto GasSpace::split_sector(Sector* sector) -> Sector* {
+    Split split = ::score(sector->parts.parts());
+    if(split.score >= score_threshold) return nullptr;
+
+    auto bounds = sector->parts.bounds();
+    auto half_one = bounds;
+    half_one.size[split.axis] = split.index - half_one.offset[split.axis];
+
+    auto half_two = bounds;
+    half_two.size[split.axis] = bounds.size[split.axis] - half_one.size[split.axis];
+    half_two.offset[split.axis] = split.index;
+
+    //
+    auto shape_one = sector->parts & half_one;
+    auto shape_two = sector->parts & half_two;
+    shape_one.compact();
+    shape_two.compact();
+
+    // Reset old sector
+    sector->parts = shape_one;
+    update_node(sector);
+    update_adjacency(sector);
+
+    // Create new one
+    return create_sector(shape_two);
+}
+
+void GasSpace::assign_id(Sector* sector){
+    if(m_free_ids.empty()){
+        sector->id = m_sector_ids.size();
+        m_sector_ids.push_back(sector);
+    } else {
+        sector->id = m_free_ids.back();
+        m_free_ids.pop_back();
+        m_sector_ids[sector->id] = sector;
+    }
+
+    if(m_voxels)
+        for(auto part : sector->parts)
+            m_voxels->fill(part, sector->id);
+}
+
+void GasSpace::index_parts(Sector* sector){
+    // Compacting usually leaves most parts where they were, only
+    // replace the entries that changed
+    uint size = sector->parts.size();
+    for(uint ii = 0; ii < sector->indexed; ii++){
+        auto key = part_key(sector->id, ii);
+        if(ii < size && m_part_lookup.find(key) == sector->parts[ii]) continue;
+        m_part_lookup.remove(key);
+        if(ii < size) m_part_lookup.insert(key, sector->parts[ii]);
+    }
+    for(uint ii = sector->indexed; ii < size; ii++)
+        m_part_lookup.insert(part_key(sector->id, ii), sector->parts[ii]);
+    sector->indexed = size;
+}
+
+void GasSpace::unindex_parts(Sector* sector){
+    for(uint ii = 0; ii < sector->indexed; ii++)
+        m_part_lookup.remove(part_key(sector->id, ii));
+    sector->indexed = 0;
+}
+
+void GasSpace::reindex_parts(){
+    std::vector<std::pair<Volume, uint64_t>> items;
+    for(auto sector : m_sector_list){
+        for(uint ii = 0; ii < sector->parts.size(); ii++)
+            items.emplace_back(sector->parts[ii], part_key(sector->id, ii));
+        sector->indexed = sector->parts.size();
+    }
+    m_part_lookup.bulk_load(std::move(items));
+}
+
+auto GasSpace::key_sector(uint64_t key) const -> Sector* {
+    return m_sector_ids[key >> 32];
+}
+
+void GasSpace::set_voxel_index(bool enabled){
+    m_voxels.reset();
+    if(!enabled) return;
+
+    m_voxels.reset(new VoxelIndex);
+    for(auto sector : m_sector_list)
+        for(auto part : sector->parts)
+            m_voxels->fill(part, sector->id);
+}
+
+//
+//      Merging sectors
+//
+
+uint GasSpace::coarsen(uint budget_us){
+    auto start = std::chrono::steady_clock::now();
+    auto budget = std::chrono::microseconds(budget_us);
+
+    // Passes over the sectors until one finds nothing to merge
+    uint merged = 0;
+    bool changed = true;
+    while(changed){
+        changed = false;
+
+        // Small sectors cost as much to step as big ones, so they go first
+        auto order = m_sector_list;
+        std::stable_sort(order.begin(), order.end(), [](Sector* a, Sector* b){
+            return a->parts.volume() < b->parts.volume();
+        });
+
+        std::unordered_set<Sector*> removed;
+        for(auto sector : order){
+            if(budget_us && std::chrono::steady_clock::now() - start >= budget){
+                resolve_doors();
+                resolve_exposures();
+                resolve_sources();
+                return merged;
+            }
+            if(removed.count(sector)) continue;
+
+            // Find the neighbour giving the best shape, if any is good
+            // enough. Ties go to the lowest id so the result is repeatable.
+            Sector* best = nullptr;
+            float best_score = score_threshold;
+            for(auto portal : sector->portals){
+                auto other = portal.first;
+                auto combined = sector->parts;
+                for(auto part : other->parts)
+                    combined.add(part);
+                combined.compact();
+
+                float value = ::score(combined.parts()).score;
+                if(value > best_score || (value == best_score && (!best || other->id < best->id))){
+                    best_score = value;
+                    best = other;
+                }
+            }
+            if(!best) continue;
+
+            // Keep the larger of the two
+            if(best->parts.volume() < sector->parts.volume())
+                std::swap(best, sector);
+            debug << "Merging sector " << sector << " into " << best << std::endl;
+            removed.insert(sector);
+            merge_sectors(best, sector);
+            merged++;
+            changed = true;
+        }
+    }
+
+    // Finishing reshapes much of the space, so pack the lookup again
+    if(merged > 0)
+        reindex_parts();
+    resolve_doors();
+    resolve_exposures();
+    resolve_sources();
+    return merged;
+}
+
+void GasSpace::merge_sectors(Sector* keep, Sector* gone){
+    for(auto part : gone->parts)
+        keep->parts.add(part);
+    keep->parts.compact();
+    if(m_voxels)
+        for(auto part : gone->parts)
+            m_voxels->fill(part, keep->id);
+
+    // The graph joins the gas and edges of the nodes, the contacts are
+    // joined the same way
+    m_graph.merge_nodes(keep->node, gone->node);
+    keep->portals.erase(gone);
+    for(auto portal : gone->portals){
+        auto other = portal.first;
+        if(other == keep) continue;
+        other->portals.erase(gone);
+        other->portals[keep] = keep->portals[other] += portal.second;
+    }
+    gone->portals.clear();
+
+    remove_sector(gone);
+    update_node(keep);
+}
+
+//
+//      Doors
+//
+
+uint GasSpace::add_door(Volume volume, float openness){
+    uint id;
+    if(m_free_doors.empty()){
+        id = m_doors.size();
+        m_doors.emplace_back();
+    } else {
+        id = m_free_doors.back();
+        m_free_doors.pop_back();
+    }
+    m_doors[id].volume = volume;
+    m_doors[id].openness = openness;
+
+    // Blocking the volume connects the door once the edit is applied
+    block(volume);
+    return id;
+}
+
+void GasSpace::remove_door(uint id){
+    m_graph.remove_valve(m_doors[id].valve);
+    m_doors[id] = Door();
+    m_free_doors.push_back(id);
+}
+
+void GasSpace::set_door_openness(uint id, float openness){
+    m_doors[id].openness = openness;
+    m_graph.set_valve_openness(m_doors[id].valve, openness);
+}
+
+void GasSpace::resolve_doors(){
+    for(auto& door : m_doors){
+        auto volume = door.volume;
+        if(!volume) continue;
+
+        // The faces just outside the door on its thinnest axis
+        int axis = 0;
+        for(int ii = 1; ii < 3; ii++)
+            if(volume.size[ii] < volume.size[axis]) axis = ii;
+        auto before = volume, after = volume;
+        before.size[axis] = after.size[axis] = 1;
+        before.offset[axis] -= 1;
+        after.offset[axis] += volume.size[axis];
+
+        auto a = main_sector(before);
+        auto b = main_sector(after);
+        GasGraph::Node node_a, node_b;
+        if(a && b && a != b){
+            node_a = a->node;
+            node_b = b->node;
+        }
+
+        // Leave the valve alone if it still joins the same nodes
+        if(m_graph.valid(door.valve) && door.a == node_a && door.b == node_b)
+            continue;
+        m_graph.remove_valve(door.valve);
+        door.valve = GasGraph::Valve();
+        door.a = node_a;
+        door.b = node_b;
+        if(m_graph.valid(node_a)){
+            float surface = before.volume();
+            door.valve = m_graph.add_valve(node_a, node_b, surface, door.openness);
+        }
+    }
+}
+
+uint GasSpace::expose(Volume volume, float density){
+    uint id;
+    if(m_free_exposures.empty()){
+        id = m_exposures.size();
+        m_exposures.emplace_back();
+    } else {
+        id = m_free_exposures.back();
+        m_free_exposures.pop_back();
+    }
+    m_exposures[id].volume = volume;
+    m_exposures[id].reservoir = m_graph.new_reservoir(density);
+    resolve_exposures();
+    return id;
+}
+
+void GasSpace::remove_exposure(uint id){
+    // The valves go with the reservoir
+    m_graph.remove_node(m_exposures[id].reservoir);
+    m_exposures[id] = Exposure();
+    m_free_exposures.push_back(id);
+}
+
+void GasSpace::set_exposure_density(uint id, float density){
+    m_graph.set_reservoir_density(m_exposures[id].reservoir, density);
+}
+
+void GasSpace::resolve_exposures(){
+    for(auto& exposure : m_exposures){
+        if(!m_graph.valid(exposure.reservoir)) continue;
+        auto volume = exposure.volume;
+        int axis = 0;
+        for(int ii = 1; ii < 3; ii++)
+            if(volume.size[ii] < volume.size[axis]) axis = ii;
+
+        // The cross section of each sector within the volume
+        std::vector<Exposure::Link> links;
+        for(auto sector : overlapping_sectors(volume)){
+            float covered = 0;
+            for(auto part : sector->parts)
+                if(part.overlap(volume))
+                    covered += (part & volume).volume();
+            links.push_back({sector->node, GasGraph::Valve(), covered / volume.size[axis]});
+        }
+        std::sort(links.begin(), links.end(), [](const Exposure::Link& a, const Exposure::Link& b){
+            return a.node.id < b.node.id;
+        });
+
+        // Leave the valves alone if they still join the same nodes
+        bool same = links.size() == exposure.links.size();
+        for(uint ii = 0; same && ii < links.size(); ii++){
+            auto& link = exposure.links[ii];
+            same = link.node == links[ii].node && link.surface == links[ii].surface
+                && m_graph.valid(link.valve);
+        }
+        if(same) continue;
+
+        for(auto& link : exposure.links)
+            m_graph.remove_valve(link.valve);
+        for(auto& link : links)
+            link.valve = m_graph.add_valve(exposure.reservoir, link.node, link.surface, 1);
+        exposure.links = std::move(links);
+    }
+}
+
+//
+//      Sources
+//
+
+uint GasSpace::add_source(Volume volume, float rate){
+    uint id;
+    if(m_free_sources.empty()){
+        id = m_sources.size();
+        m_sources.emplace_back();
+    } else {
+        id = m_free_sources.back();
+        m_free_sources.pop_back();
+    }
+    m_sources[id].volume = volume;
+    m_sources[id].rate = rate;
+    resolve_sources();
+    return id;
+}
+
+void GasSpace::remove_source(uint id){
+    for(auto& link : m_sources[id].links)
+        m_graph.remove_source(link.source);
+    m_sources[id] = Source();
+    m_free_sources.push_back(id);
+}
+
+void GasSpace::set_source_rate(uint id, float rate){
+    auto& source = m_sources[id];
+    source.rate = rate;
+    for(auto& link : source.links)
+        m_graph.set_source(link.source, link.node, rate * link.share);
+}
+
+void GasSpace::resolve_sources(){
+    for(auto& source : m_sources){
+        if(!source.volume) continue;
+
+        // Sectors never overlap, so while the sectors covering the volume
+        // haven't changed nothing else can be in the part they cover. The
+        // rest stays wall until space is opened somewhere.
+        bool same = source.covered > 0.999f || source.opened == m_opened;
+        for(auto& link : source.links){
+            auto sector = m_sector_ids.size() > link.sector ? m_sector_ids[link.sector] : nullptr;
+            same = same && sector && sector->version == link.version && sector->node == link.node;
+        }
+        if(same) continue;
+
+        for(auto& link : source.links)
+            m_graph.remove_source(link.source);
+        source.links.clear();
+        source.covered = 0;
+        source.opened = m_opened;
+
+        for(auto sector : overlapping_sectors(source.volume)){
+            float share = 0;
+            for(auto part : sector->parts)
+                if(part.overlap(source.volume))
+                    share += (part & source.volume).volume();
+            share /= source.volume.volume();
+            uint id = m_graph.add_source(sector->node, source.rate * share);
+            source.links.push_back({id, sector->node, sector->id, sector->version, share});
+            source.covered += share;
+        }
+    }
+}
+
+auto GasSpace::main_sector(Volume volume) const -> Sector* {
+    Sector* best = nullptr;
+    float most = 0;
+    for(auto sector : overlapping_sectors(volume)){
+        float covered = 0;
+        for(auto part : sector->parts)
+            if(part.overlap(volume))
+                covered += (part & volume).volume();
+        if(covered > most){
+            most = covered;
+            best = sector;
+        }
+    }
+    return best;
+}
+
+//
+//      Lazy partitioning
+//
+
+void GasSpace::set_lazy_partition(bool lazy){
+    m_lazy_partition = lazy;
+}
+
+uint GasSpace::maintain(uint budget_us){
+    auto start = std::chrono::steady_clock::now();
+    auto budget = std::chrono::microseconds(budget_us);
+
+    while(!m_partition_queue.empty() && std::chrono::steady_clock::now() - start < budget){
+        auto sector = m_partition_queue.front();
+        m_partition_queue.pop_front();
+
+        // Removed sectors are taken out of the pending set, but left in
+        // the queue
+        if(!m_partition_pending.erase(sector)) continue;
+
+        // The halves go back through the connectivity check, and then
+        // back onto the queue
+        auto new_sector = split_sector(sector);
+        if(new_sector){
+            partition_sector(sector);
+            partition_sector(new_sector);
+        }
+    }
+
+    resolve_doors();
+    resolve_exposures();
+    resolve_sources();
+    return m_partition_pending.size();
+}
+
 //
 //
 //
 
 void GasSpace::update_node(Sector* sector){
+    // The sector's shape has changed
+    sector->version = ++m_last_version;
+    index_parts(sector);
+
     //
-    sector->node->volume = sector->parts.volume();
-    sector->node->surface = sector->parts.surface();
-    std::cout << "new data " << sector->node->volume
-        << " " << sector->node->surface << std::endl;
+    m_graph.set_volume(sector->node, sector->parts.volume());
+    m_graph.set_surface(sector->node, sector->parts.surface());
+    std::cout << "new data " << m_graph.volume(sector->node)
+        << " " << m_graph.surface(sector->node) << std::endl;
 }
 
 void GasSpace::update_adjacency(Sector* sector){
+    // While edits are being applied just note it for later
+    if(m_deferring){
+        if(m_dirty.insert(sector).second)
+            m_dirty_list.push_back(sector);
+        return;
+    }
+
     // Clear existing adjacencies
+    for(auto portal : sector->portals)
+        portal.first->portals.erase(sector);
+    sector->portals.clear();
     m_graph.clear_edges(sector->node);
 
     for(auto other : adjacent_sectors(sector)){
         if(other == sector) continue;
         // Calculate the contact area between the sectors
         float new_contact = sector->parts.contact(other->parts);
-        m_graph.set_edge(sector->node, other->node, new_contact);
+        if(new_contact > 0)
+            add_contact(sector, other, new_contact);
+    }
+}
+
+void GasSpace::add_contact(Sector* a, Sector* b, float change){
+    if(change == 0) return;
+
+    // Areas are whole numbers, anything close to zero is nothing
+    float area = a->portals[b] += change;
+    if(area < 0.5){
+        a->portals.erase(b);
+        b->portals.erase(a);
+        m_graph.clear_edge(a->node, b->node);
+    } else {
+        b->portals[a] = area;
+        m_graph.set_edge(a->node, b->node, area);
     }
 }
 
@@ -431,7 +1143,25 @@ std::tuple<float, Volume> GasSpace::choose_addition(Sector* sector, Volume input
 }
 
 float GasSpace::score_addition(Sector* sector, Volume input) const {
+    auto found = m_score_cache.find(ScoreKey{sector->version, input});
+    if(found != m_score_cache.end())
+        return found->second;
+
     std::vector<Volume> new_volumes = sector->parts.parts();
     new_volumes.push_back(input);
-    return ::score(new_volumes).score;
+    float value = ::score(new_volumes).score;
+    m_score_cache.emplace(ScoreKey{sector->version, input}, value);
+    return value;
+}
+
+bool GasSpace::ScoreKey::operator == (const ScoreKey& o) const {
+    return version == o.version && volume == o.volume;
+}
+
+size_t GasSpace::ScoreKeyHash::operator()(const ScoreKey& key) const {
+    uint64_t hash = key.version;
+    for(int value : {key.volume.offset.x, key.volume.offset.y, key.volume.offset.z,
+            int(key.volume.size.x), int(key.volume.size.y), int(key.volume.size.z)})
+        hash = (hash ^ uint32_t(value)) * 0x100000001b3ull;
+    return hash;
 }
@@ -13,8 +13,14 @@
 #include "GasGraph.hpp"
 #include "Volume.hpp"
 #include "RTree.hpp"
+#include "VoxelIndex.hpp"
 
+#include <deque>
+#include <memory>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /**
  * Manage the mapping from 3d integer space to a GasGraph.
@@ -24,12 +30,28 @@ public:
     // An irregular, but connected, cluster of volumes that are represented
     // by a single node in the gas graph.
     struct Sector {
-        GasGraph::Node * node;
+        GasGraph::Node node;
         Cluster parts;
+        // Small number naming the sector in the voxel index, never zero
+        uint32_t id = 0;
+        // The contact area with each neighbouring sector, mirrored in the
+        // neighbour and in the edges of the gas graph
+        std::unordered_map<Sector*, float> portals;
+        // How many of the parts are in the part lookup
+        uint indexed = 0;
+        // Changes every time the parts do, never repeated by any sector
+        uint64_t version = 0;
         bool adjacent(Volume) const;
         Volume bounds() const;
     };
 
+    // A copy of the arrangement of the sectors. Edges join sectors by their
+    // position in the list, with the contact area between them.
+    struct Layout {
+        std::vector<Cluster> sectors;
+        std::vector<std::tuple<uint, uint, float>> edges;
+    };
+
 public:
     // Construct/Destruct
     GasSpace(uint);
@@ -38,6 +60,12 @@ public:
 public:
     // Let the gas flow between the nodes a bit.
     void step(float);
+    // Step several times in a row, to catch up or fast forward
+    void step_n(float, uint);
+    // Let sectors within this many pascals of all their neighbours stop
+    // being stepped until something disturbs them. Zero, the default,
+    // keeps every sector stepping.
+    void set_sleep_tolerance(float);
 
 public:
     // Declare that a section of space is not passible to gas.
@@ -45,23 +73,85 @@ public:
     // Declare that a section of space is passible to gas.
     void clear(Volume);
 
+    // Group block and clear calls into a single edit. Nothing changes until
+    // the matching commit, then overlapping edits are merged (the later one
+    // winning) and each sector is updated once. Edits may be nested.
+    void begin_edit();
+    void commit();
+
+    // Sectors that are disconnected are always split right away. In lazy
+    // mode sectors that are just badly shaped are queued to be split by
+    // maintain, rather than during the edit.
+    void set_lazy_partition(bool);
+    // Split queued sectors for up to the given time in microseconds,
+    // giving the number of sectors still waiting
+    uint maintain(uint budget_us);
+
+    // Merge neighbouring sectors where the combined shape is good enough
+    // that it wouldn't be split again, smallest sectors first. Runs for up
+    // to the given time in microseconds (zero for no limit) and gives the
+    // number of sectors merged away.
+    uint coarsen(uint budget_us = 0);
+
+    // Keep a voxel index of which sector covers each point, making point
+    // lookups exact and constant time at the cost of memory.
+    void set_voxel_index(bool);
+
+    // A door blocks a volume and joins the space on either side of it,
+    // along its thinnest axis, through a valve in the gas graph. Opening
+    // and closing the door (0 closed to 1 fully open) never changes the
+    // sectors. The door is connected again whenever the sectors change.
+    uint add_door(Volume, float openness);
+    void remove_door(uint);
+    void set_door_openness(uint, float);
+
+    // Expose the space in a volume to the outside, a reservoir holding gas
+    // at a fixed density (zero for vacuum). Every sector in the volume is
+    // joined to the reservoir through its cross section on the volume's
+    // thinnest axis, and joined again whenever the sectors change.
+    uint expose(Volume, float density);
+    void remove_exposure(uint);
+    void set_exposure_density(uint, float);
+
+    // Register a source of gas over a volume, or a single point, at a rate
+    // in mass per second, negative for a sink. The rate is shared between
+    // the sectors by how much of the volume they cover, the part in solid
+    // space is lost. The sectors are only looked up again once they change,
+    // and the gas is added as part of stepping the graph.
+    uint add_source(Volume, float rate);
+    void remove_source(uint);
+    void set_source_rate(uint, float);
+
     // Measure how much gas is at a point in space
     float air_at(Point) const;
+    float pressure_at(Point) const;
     // Add gas to a point in space.
     // If this point is not passible to gas nothing happens.
     void add_air(Point, float);
 
+    // The same for many points at once, much faster than one at a time.
+    // Results are written in the same order as the points.
+    void air_at(const Point*, size_t, float*) const;
+    void pressure_at(const Point*, size_t, float*) const;
+    void add_air(const Point*, const float*, size_t);
+
 public:
     // How many sectors is the space broken into.
     uint size() const;
     // Give a string describing the structure of the sectors.
     std::string describe() const;
+    // Copy out the current arrangement of the sectors
+    Layout layout() const;
 
 protected:
     // There should be at most one sector covering a given point,
     // find that sector or null
     Sector * find_sector(Point) const;
 
+    // Find the sectors for many points, visiting them in Morton order so
+    // that queries near each other share work
+    void find_sectors(const Point*, size_t, Sector**) const;
+
     // Get the sectors that overlap with the given volume
     std::vector<Sector*> overlapping_sectors(Volume) const;
 
@@ -80,18 +170,50 @@ protected:
 
     // Remove a sector from the problem
     void remove_sector(Sector*);
+    // Give a new sector an id, and mark its space in the voxel index
+    void assign_id(Sector*);
+    // Bring the part lookup in line with the parts of a sector
+    void index_parts(Sector*);
+    void unindex_parts(Sector*);
+    // Rebuild the part lookup from scratch, fully packed
+    void reindex_parts();
+    // The sector a key in the part lookup belongs to
+    Sector* key_sector(uint64_t) const;
 
     // Add a volume to a sector
     void expand(Sector*, Volume);
 
     // Break a sector if needed
     void partition_sector(Sector*);
+    // Split a badly shaped sector in two, giving the new one or null
+    Sector* split_sector(Sector*);
+    // Fold the second sector into the first, then remove it
+    void merge_sectors(Sector*, Sector*);
+
+    // Find the sectors on either side of each door and connect them
+    void resolve_doors();
+    // Join the sectors in each exposed volume to its reservoir
+    void resolve_exposures();
+    // Point each source at the sectors now covering its volume
+    void resolve_sources();
+    // The sector covering most of a volume
+    Sector* main_sector(Volume) const;
+
+protected:
+    // Apply all of the waiting edits
+    void apply_edits();
+    // Take space away from sectors, giving the sectors that changed
+    std::vector<Sector*> block_cluster(const Cluster&);
+    // Give space to existing or new sectors
+    void clear_volume(Volume);
 
 protected:
     // Update the surface area and volume information in the Gas Graph node.
     void update_node(Sector*);
-    // Update the adjacency information between this node and its neighbours.
+    // Recalculate the contact between this sector and all its neighbours.
     void update_adjacency(Sector*);
+    // Change the contact area between two sectors
+    void add_contact(Sector*, Sector*, float);
 
 protected:
     // Check if there is a part of the given volume that this sector
@@ -101,6 +223,22 @@ protected:
     // Measure the effect on the quality of the sector by the addition
     // of the given volume
     float score_addition(Sector*, Volume) const;
+
+    // Scores from score_addition by sector version and added volume, kept
+    // until the current edits are applied. Fitting a cleared volume tries
+    // the same fragments against the same sectors many times.
+    struct ScoreKey {
+        uint64_t version;
+        Volume volume;
+        bool operator == (const ScoreKey&) const;
+    };
+    struct ScoreKeyHash {
+        size_t operator()(const ScoreKey&) const;
+    };
+    mutable std::unordered_map<ScoreKey, float, ScoreKeyHash> m_score_cache;
+    uint64_t m_last_version = 0;
+    // Count of times clear_volume found space that wasn't already open
+    uint64_t m_opened = 0;
     // Minimal reasonable value for score_addition
     const float score_threshold = 1;
 
@@ -110,7 +248,81 @@ protected:
 
     // List of all sectors in no particular order
     std::vector<Sector*> m_sector_list;
-    RTree<Sector*> m_sector_lookup;
+    // Every part of every sector, keyed by the sector id and the position
+    // of the part in the sector's cluster
+    RTree<uint64_t> m_part_lookup;
+
+    // Edits waiting for a commit, and how deeply edits are nested
+    struct Edit {
+        Volume volume;
+        bool blocked;
+    };
+    std::vector<Edit> m_edits;
+    uint m_edit_depth = 0;
+
+    // While edits are applied, sectors that need their adjacency updated
+    bool m_deferring = false;
+    std::vector<Sector*> m_dirty_list;
+    std::unordered_set<Sector*> m_dirty;
+
+    // Sectors by id, and the ids free to be reused
+    std::vector<Sector*> m_sector_ids{nullptr};
+    std::vector<uint32_t> m_free_ids;
+    // Optional index from each point to the id of the sector covering it
+    std::unique_ptr<VoxelIndex> m_voxels;
+
+    // Doors by id, unused ids have no volume. The valve joins the nodes on
+    // either side, as they were when the door was last resolved.
+    struct Door {
+        Volume volume;
+        float openness = 0;
+        GasGraph::Valve valve;
+        GasGraph::Node a, b;
+    };
+    std::vector<Door> m_doors;
+    std::vector<uint> m_free_doors;
+
+    // Exposures by id, unused ids have no reservoir. Each sector in the
+    // volume is joined to the reservoir through a valve, left open.
+    struct Exposure {
+        Volume volume;
+        GasGraph::Node reservoir;
+        struct Link {
+            GasGraph::Node node;
+            GasGraph::Valve valve;
+            float surface;
+        };
+        std::vector<Link> links;
+    };
+    std::vector<Exposure> m_exposures;
+    std::vector<uint> m_free_exposures;
+
+    // Sources by id, unused ids have no volume. Each sector covering the
+    // volume has a source in the graph, the sector's id and version tell
+    // when it has changed. The part of the volume no sector covered can
+    // only gain one when space is opened, which m_opened counts.
+    struct Source {
+        Volume volume;
+        float rate = 0;
+        float covered = 0;
+        uint64_t opened = uint64_t(-1);
+        struct Link {
+            uint source;
+            GasGraph::Node node;
+            uint32_t sector;
+            uint64_t version;
+            // Fraction of the volume covered by the sector
+            float share;
+        };
+        std::vector<Link> links;
+    };
+    std::vector<Source> m_sources;
+    std::vector<uint> m_free_sources;
+
+    // Sectors waiting to be checked for splitting in lazy mode
+    bool m_lazy_partition = false;
+    std::deque<Sector*> m_partition_queue;
+    std::unordered_set<Sector*> m_partition_pending;
 };
 
 #endif
@@ -8,30 +8,42 @@
 /**
  * An R-Tree template for spacial searching.
  *
- * Fairly simple implementation without any special tricks.
- * Has not been tuned or profiled.
+ * The nodes are kept in a single arena and refer to each other by index.
+ * Each node stores the bounds of its children as rows of coordinates, so
+ * a search tests every child of a node at once with the overlap kernel.
  */
 #ifndef HPPB_SRC_RTREE_HPP
 #define HPPB_SRC_RTREE_HPP
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
 
 #include "Volume.hpp"
 #include "Cluster.hpp"
+#include "overlap.hpp"
 
-#define RTREE_TEMPLATE template <class Type, int Dimensions, int MinChildren, int MaxChildren>
-#define RTREE_CLASS RTree<Type, Dimensions, MinChildren, MaxChildren>
-#define RTREENODE_CLASS RTreeNode<Type, Dimensions, MinChildren, MaxChildren>
+#define RTREE_TEMPLATE template <class Type, int Dimensions, int MinChildren, int MaxChildren, class Policy>
+#define RTREE_CLASS RTree<Type, Dimensions, MinChildren, MaxChildren, Policy>
 
-RTREE_TEMPLATE
-class RTreeNode;
-
-template <class Type, int Dimensions=3, int MinChildren=4, int MaxChildren=32>
+// How values are placed in the tree.
+//
+// The basic policy descends by least area enlargement and splits the
+// longest axis at the median.
+//
+// The R* policy descends into leaves by least overlap enlargement, and
+// splits on the axis with the smallest total margin at the point with the
+// least overlap. When a leaf first overflows during an insert, the values
+// furthest from its center are inserted again from the root instead.
+struct RTreeBasic {};
+struct RTreeStar {};
+
+template <class Type, int Dimensions=3, int MinChildren=4, int MaxChildren=32, class Policy=RTreeBasic>
 class RTree {
-public:
-    typedef RTreeNode<Type, Dimensions, MinChildren, MaxChildren> NodeType;
-
 public:
     RTree();
     ~RTree();
@@ -40,6 +52,10 @@ public:
     void insert(Type, Volume);
     void move(Type, Volume);
     void remove(Type);
+    // Replace the contents of the tree, building it bottom up with every
+    // node full using sort-tile-recursive ordering. Much faster than
+    // inserting the items one at a time, with less overlap between nodes.
+    void bulk_load(std::vector<std::pair<Volume, Type>>);
 
 public:
     std::vector<Type> intersecting(Volume) const;
@@ -47,390 +63,610 @@ public:
     Volume find(Type) const;
 
 protected:
-    void split_root();
-
-protected:
-    NodeType * m_root = nullptr;
-    std::unordered_map<Type, Volume> m_locations;
-};
-
-//
-//  Node declaration
-//
-
-RTREE_TEMPLATE
-class RTreeNode {
-public:
-    typedef RTreeNode<Type, Dimensions, MinChildren, MaxChildren> NodeType;
-    friend RTREE_CLASS;
-
-public:
-    RTreeNode();
-    RTreeNode(const std::vector<NodeType*>&);
-    RTreeNode(const std::vector<std::pair<Volume, Type>>&);
-    ~RTreeNode();
-
-public:
-    void insert(Type, Volume);
-    // Returns whether the bounding box has changed
-    bool remove(Type, Volume);
-
-public:
-    void intersecting(Volume, std::vector<Type>&) const;
-    void inside(Volume, std::vector<Type>&) const;
-    void all(std::vector<std::pair<Volume, Type>>&) const;
-
-public:
-    uint size() const;
-    // TODO re-implement to be in constant time
-    uint real_size() const;
+    // The bounds of a child and the node or value slot it refers to
+    typedef std::pair<Volume, uint32_t> Entry;
+
+    // Nodes have room for one child over the maximum before they are
+    // split, rounded up to whole vectors for the overlap kernel. The
+    // bounds are the low corner and one past the high corner.
+    static constexpr uint capacity = (MaxChildren + 1 + 7) / 8 * 8;
+    static_assert(capacity <= 64, "Nodes can have at most 64 children");
+    // Volume and the overlap kernel both have exactly three axes
+    static_assert(Dimensions == 3, "RTree only supports three dimensions");
+    struct Node {
+        int32_t low[Dimensions][capacity];
+        int32_t high[Dimensions][capacity];
+        uint32_t child[capacity];
+        uint32_t count = 0;
+        bool leaf = true;
+    };
+    static constexpr bool star = std::is_same<Policy, RTreeStar>::value;
+    static constexpr uint32_t no_node = uint32_t(-1);
+
+    // Take nodes and value slots from the arena, or give them back
+    uint32_t new_node(bool leaf);
+    void free_subtree(uint32_t);
+    uint32_t new_value(Type);
+
+    // Read and write the children of a node
+    Volume child_bounds(uint32_t node, uint index) const;
+    void set_child(uint32_t node, uint index, Volume, uint32_t child);
+    void add_child(uint32_t node, Volume, uint32_t child);
+    void remove_child(uint32_t node, uint index);
+    std::vector<Entry> entries(uint32_t node) const;
+    void set_entries(uint32_t node, const std::vector<Entry>&);
+    Volume node_bounds(uint32_t node) const;
+    BoxRows rows(uint32_t node) const;
+
+    // Collect the values under a node that overlap a volume, or only those
+    // contained in it
+    void search(uint32_t node, Volume, bool contained, std::vector<Type>&) const;
+
+    // Insert into the subtree under a node, returning a new sibling for the
+    // node if it had to split. Under the R* policy an overflowing leaf
+    // moves some of its values to the evicted list instead, if one is
+    // given and still empty.
+    uint32_t insert_entry(uint32_t node, Entry, std::vector<Entry>* evicted);
+    // Insert at the root, growing the tree if the root splits
+    void insert_root(Entry, std::vector<Entry>* evicted);
+    // Remove a value from the subtree under a node, moving the values of
+    // any node left underfull to the orphan list
+    bool remove_entry(uint32_t node, Volume, Type, std::vector<Entry>& orphans);
+    // Collect every value under a node
+    void gather(uint32_t node, std::vector<Entry>&) const;
+
+    // Exact volume of a box, Volume::volume is a float
+    static int64_t size(Volume);
+    // Pick the child to descend into for a new volume
+    uint choose_child(uint32_t node, Volume) const;
+    // Split a node in two, returning the new one
+    uint32_t split(uint32_t node);
+    // Move the values furthest from the center of a leaf to a list
+    void evict(uint32_t node, std::vector<Entry>&);
+
+    // Sort entries for an R* split, returning how many go to the first node
+    static size_t star_split(std::vector<Entry>&);
+    // Sort a range of items into tiles, by their center on the given axis
+    // and then recursively on the remaining axes within each slab
+    static void tile(std::vector<Entry>&, size_t, size_t, int);
+    // Break a list of tiled items into nodes
+    static std::vector<std::pair<size_t, size_t>> pack(size_t);
 
 protected:
-    int64_t expansion(Volume) const;
-    NodeType* split_self();
-    void absorb_child(NodeType*);
-    void split_child(NodeType*);
-    void update_bounds();
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_free_nodes;
+    uint32_t m_root = no_node;
 
-protected:
-    const bool m_internal;
-    std::vector<std::pair<Volume, Type>> m_data;
-    std::vector<NodeType*> m_children;
-    Volume m_bounds;
+    // Leaves refer to their values by slot
+    std::vector<Type> m_values;
+    std::vector<uint32_t> m_free_values;
+    std::unordered_map<Type, Volume> m_locations;
 };
 
 //
-//  RTree implementation
+//  Public interface
 //
 
 RTREE_TEMPLATE RTREE_CLASS::RTree(){
-    m_root = new NodeType;
+    m_root = new_node(true);
 }
 
-RTREE_TEMPLATE RTREE_CLASS::~RTree(){
-    delete m_root;
-}
+RTREE_TEMPLATE RTREE_CLASS::~RTree(){}
 
 RTREE_TEMPLATE
 void RTREE_CLASS::insert(Type value, Volume bounds){
-    m_root->insert(value, bounds);
+    std::vector<Entry> evicted;
+    insert_root(Entry(bounds, new_value(value)), &evicted);
     m_locations[value] = bounds;
-    split_root();
+
+    // Values moved out of an overflowing leaf go back in from the top,
+    // this time splitting anything that overflows
+    for(auto item : evicted)
+        insert_root(item, nullptr);
 }
 
 RTREE_TEMPLATE
 void RTREE_CLASS::move(Type value, Volume bounds){
-    m_root->remove(value, m_locations[value]);
-    m_root->insert(value, bounds);
-    m_locations[value] = bounds;
+    remove(value);
+    insert(value, bounds);
 }
 
 RTREE_TEMPLATE
 void RTREE_CLASS::remove(Type value){
-    if(!m_locations.count(value)) return;
-    m_root->remove(value, m_locations[value]);
-    m_locations.erase(value);
+    auto found = m_locations.find(value);
+    if(found == m_locations.end()) return;
+
+    std::vector<Entry> orphans;
+    remove_entry(m_root, found->second, value, orphans);
+    m_locations.erase(found);
+
+    // A root left with a single child is replaced by it
+    while(!m_nodes[m_root].leaf && m_nodes[m_root].count <= 1){
+        uint32_t old = m_root;
+        if(m_nodes[old].count == 0){
+            m_nodes[old].leaf = true;
+            break;
+        }
+        m_root = m_nodes[old].child[0];
+        m_nodes[old].count = 0;
+        free_subtree(old);
+    }
+
+    for(auto item : orphans)
+        insert_root(item, nullptr);
+}
+
+RTREE_TEMPLATE
+void RTREE_CLASS::bulk_load(std::vector<std::pair<Volume, Type>> items){
+    m_nodes.clear();
+    m_free_nodes.clear();
+    m_values.clear();
+    m_free_values.clear();
+    m_locations.clear();
+
+    std::vector<Entry> level;
+    for(auto& item : items){
+        m_locations[item.second] = item.first;
+        level.emplace_back(item.first, new_value(item.second));
+    }
+
+    // Pack the values into leaves, then each level into the one above
+    // until it fits in the root
+    bool leaf = true;
+    do {
+        tile(level, 0, level.size(), 0);
+        std::vector<Entry> above;
+        for(auto group : pack(level.size())){
+            uint32_t node = new_node(leaf);
+            set_entries(node, std::vector<Entry>(level.begin() + group.first, level.begin() + group.second));
+            above.emplace_back(node_bounds(node), node);
+        }
+        level = std::move(above);
+        leaf = false;
+    } while(level.size() > MaxChildren);
+
+    if(level.size() == 1){
+        m_root = level.front().second;
+    } else {
+        m_root = new_node(level.empty());
+        set_entries(m_root, level);
+    }
 }
 
 RTREE_TEMPLATE
 std::vector<Type> RTREE_CLASS::intersecting(Volume bounds) const {
     std::vector<Type> output;
-    m_root->intersecting(bounds, output);
+    search(m_root, bounds, false, output);
     return output;
 }
 
 RTREE_TEMPLATE
 std::vector<Type> RTREE_CLASS::inside(Volume bounds) const {
     std::vector<Type> output;
-    m_root->inside(bounds, output);
+    search(m_root, bounds, true, output);
     return output;
 }
 
 RTREE_TEMPLATE
 Volume RTREE_CLASS::find(Type value) const {
-    return m_locations[value];
+    return m_locations.at(value);
 }
 
 RTREE_TEMPLATE
-void RTREE_CLASS::split_root(){
-    if(m_root->size() > MaxChildren){
-        auto other = m_root->split_self();
-        m_root = new NodeType(std::vector<NodeType*>{m_root, other});
+void RTREE_CLASS::search(uint32_t id, Volume bounds, bool contained, std::vector<Type>& output) const {
+    const int32_t low[3] = {bounds.offset.x, bounds.offset.y, bounds.offset.z};
+    const int32_t high[3] = {low[0] + int32_t(bounds.size.x), low[1] + int32_t(bounds.size.y), low[2] + int32_t(bounds.size.z)};
+    const Node& node = m_nodes[id];
+
+    uint64_t mask = overlap_mask(rows(id), node.count, low, high);
+    while(mask){
+        uint index = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if(!node.leaf){
+            search(node.child[index], bounds, contained, output);
+            continue;
+        }
+
+        bool inside = true;
+        for(int axis = 0; contained && axis < 3; axis++)
+            inside = inside && low[axis] <= node.low[axis][index] && node.high[axis][index] <= high[axis];
+        if(inside)
+            output.push_back(m_values[node.child[index]]);
     }
 }
 
 //
-//  Node implementation
+//  The arena
 //
 
 RTREE_TEMPLATE
-RTREENODE_CLASS::RTreeNode()
-:   m_internal(false)
-{
+uint32_t RTREE_CLASS::new_node(bool leaf){
+    uint32_t node;
+    if(m_free_nodes.empty()){
+        node = m_nodes.size();
+        m_nodes.emplace_back();
+    } else {
+        node = m_free_nodes.back();
+        m_free_nodes.pop_back();
+    }
+    m_nodes[node].count = 0;
+    m_nodes[node].leaf = leaf;
+    return node;
 }
 
 RTREE_TEMPLATE
-RTREENODE_CLASS::RTreeNode(const std::vector<NodeType*>& data)
-:   m_internal(true)
-,   m_children(data)
-{
-    update_bounds();
+void RTREE_CLASS::free_subtree(uint32_t node){
+    if(!m_nodes[node].leaf){
+        for(uint ii = 0; ii < m_nodes[node].count; ii++)
+            free_subtree(m_nodes[node].child[ii]);
+    }
+    m_nodes[node].count = 0;
+    m_free_nodes.push_back(node);
 }
 
 RTREE_TEMPLATE
-RTREENODE_CLASS::RTreeNode(const std::vector<std::pair<Volume, Type>>& data)
-:   m_internal(false)
-,   m_data(data)
-{
-    update_bounds();
+uint32_t RTREE_CLASS::new_value(Type value){
+    if(m_free_values.empty()){
+        m_values.push_back(value);
+        return m_values.size() - 1;
+    }
+    uint32_t slot = m_free_values.back();
+    m_free_values.pop_back();
+    m_values[slot] = value;
+    return slot;
 }
 
+RTREE_TEMPLATE
+Volume RTREE_CLASS::child_bounds(uint32_t node, uint index) const {
+    auto& item = m_nodes[node];
+    return Volume(
+        {item.low[0][index], item.low[1][index], item.low[2][index]},
+        {item.high[0][index] - item.low[0][index], item.high[1][index] - item.low[1][index],
+         item.high[2][index] - item.low[2][index]}
+    );
+}
 
 RTREE_TEMPLATE
-RTREENODE_CLASS::~RTreeNode(){
-    if(m_internal){
-        for(auto child : m_children)
-            delete child;
+void RTREE_CLASS::set_child(uint32_t node, uint index, Volume bounds, uint32_t child){
+    auto& item = m_nodes[node];
+    for(int axis = 0; axis < 3; axis++){
+        item.low[axis][index] = bounds.offset[axis];
+        item.high[axis][index] = bounds.offset[axis] + bounds.size[axis];
     }
+    item.child[index] = child;
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::insert(Type value, Volume bounds){
-    if(m_internal){
-        // See which of the child nodes will expand the least to include
-        // the new value
-        NodeType* candidate = m_children.front();
-        auto expansion = candidate->expansion(bounds);
-
-        for(auto node : m_children){
-            auto node_expansion = node->expansion(bounds);
-            if(node_expansion < expansion){
-                expansion = node_expansion;
-                candidate = node;
-            } else if (node_expansion == expansion){
-                // Break ties in expansion with occupancy
-                if(node->size() < candidate->size())
-                    candidate = node;
-            }
-        }
-
-        // Put the new data in the selected child
-        candidate->insert(value, bounds);
-        m_bounds = m_bounds | candidate->m_bounds;
-        split_child(candidate);
+void RTREE_CLASS::add_child(uint32_t node, Volume bounds, uint32_t child){
+    set_child(node, m_nodes[node].count++, bounds, child);
+}
 
-    } else {
-        // Add to the leves in this node and increase the bounding box
-        m_data.emplace_back(bounds, value);
-        if(m_data.size() == 1)
-            m_bounds = bounds;
-        else
-            m_bounds = m_bounds | bounds;
+RTREE_TEMPLATE
+void RTREE_CLASS::remove_child(uint32_t node, uint index){
+    // Move the last child into the gap
+    auto& item = m_nodes[node];
+    uint last = --item.count;
+    for(int axis = 0; axis < 3; axis++){
+        item.low[axis][index] = item.low[axis][last];
+        item.high[axis][index] = item.high[axis][last];
     }
+    item.child[index] = item.child[last];
 }
 
 RTREE_TEMPLATE
-bool RTREENODE_CLASS::remove(Type value, Volume bounds){
-    auto starting_bounds = m_bounds;
-    bool update = false;
-
-    if(m_internal){
-        std::vector<NodeType*> called_children;
-        for(auto child : m_children){
-            if(child->m_bounds.overlap(bounds)){
-                update |= child->remove(value, bounds);
-                called_children.push_back(child);
-            }
-        }
-        for(auto child : called_children)
-            absorb_child(child);
-    } else {
-        for(uint ii = 0; ii < m_data.size(); ii++){
-            if(m_data[ii].second == value){
-                update = true;
-                std::swap(m_data[ii], m_data.back());
-                m_data.pop_back();
-                break;
-            }
-        }
-    }
+auto RTREE_CLASS::entries(uint32_t node) const -> std::vector<Entry> {
+    std::vector<Entry> out;
+    for(uint ii = 0; ii < m_nodes[node].count; ii++)
+        out.emplace_back(child_bounds(node, ii), m_nodes[node].child[ii]);
+    return out;
+}
 
-    if(update) update_bounds();
-    return m_bounds != starting_bounds;
+RTREE_TEMPLATE
+void RTREE_CLASS::set_entries(uint32_t node, const std::vector<Entry>& items){
+    m_nodes[node].count = 0;
+    for(auto& item : items)
+        add_child(node, item.first, item.second);
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::intersecting(Volume bounds, std::vector<Type>& output) const{
-    if(m_internal){
-        for(auto child : m_children){
-            if(child->m_bounds.overlap(bounds)){
-                child->intersecting(bounds, output);
-            }
-        }
-    } else {
-        for(auto child : m_data){
-            if(child.first.overlap(bounds)){
-                output.push_back(child.second);
-            }
-        }
-    }
+Volume RTREE_CLASS::node_bounds(uint32_t node) const {
+    // Nodes can be emptied by removal before they are dropped
+    if(m_nodes[node].count == 0) return Volume();
+    Volume bounds = child_bounds(node, 0);
+    for(uint ii = 1; ii < m_nodes[node].count; ii++)
+        bounds = bounds | child_bounds(node, ii);
+    return bounds;
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::inside(Volume bounds, std::vector<Type>& output) const {
-    if(m_internal){
-        for(auto child : m_children){
-            if(child->m_bounds.overlap(bounds)){
-                child->inside(bounds, output);
-            }
-        }
-    } else {
-        for(auto child : m_data){
-            if(bounds.contains(child.first)){
-                output.push_back(child.second);
-            }
-        }
+BoxRows RTREE_CLASS::rows(uint32_t node) const {
+    auto& item = m_nodes[node];
+    return BoxRows{{item.low[0], item.low[1], item.low[2]}, {item.high[0], item.high[1], item.high[2]}};
+}
+
+//
+//  Editing
+//
+
+RTREE_TEMPLATE
+void RTREE_CLASS::insert_root(Entry item, std::vector<Entry>* evicted){
+    uint32_t sibling = insert_entry(m_root, item, evicted);
+    if(sibling != no_node){
+        uint32_t old = m_root;
+        m_root = new_node(false);
+        add_child(m_root, node_bounds(old), old);
+        add_child(m_root, node_bounds(sibling), sibling);
     }
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::all(std::vector<std::pair<Volume, Type>>& output) const {
-    if(m_internal){
-        for(auto child : m_children)
-            child->all(output);
-    } else {
-        output.insert(output.end(), m_data.begin(), m_data.end());
+uint32_t RTREE_CLASS::insert_entry(uint32_t node, Entry item, std::vector<Entry>* evicted){
+    if(m_nodes[node].leaf){
+        add_child(node, item.first, item.second);
+        if(m_nodes[node].count <= MaxChildren) return no_node;
+        if(star && evicted && evicted->empty()){
+            evict(node, *evicted);
+            return no_node;
+        }
+        return split(node);
+    }
+
+    // Put the new data in the selected child. If it split or gave values
+    // up its bounds have to be found again, otherwise they just grow.
+    uint index = choose_child(node, item.first);
+    uint32_t child = m_nodes[node].child[index];
+    uint32_t sibling = insert_entry(child, item, evicted);
+    if(sibling == no_node && (!evicted || evicted->empty())){
+        set_child(node, index, child_bounds(node, index) | item.first, child);
+        return no_node;
     }
+    set_child(node, index, node_bounds(child), child);
+    if(sibling == no_node) return no_node;
+
+    add_child(node, node_bounds(sibling), sibling);
+    return m_nodes[node].count > MaxChildren ? split(node) : no_node;
 }
 
 RTREE_TEMPLATE
-uint RTREENODE_CLASS::size() const {
-    if(m_internal){
-        return m_children.size();
-    } else {
-        return m_data.size();
+bool RTREE_CLASS::remove_entry(uint32_t node, Volume bounds, Type value, std::vector<Entry>& orphans){
+    if(m_nodes[node].leaf){
+        for(uint ii = 0; ii < m_nodes[node].count; ii++){
+            uint32_t slot = m_nodes[node].child[ii];
+            if(m_values[slot] == value){
+                remove_child(node, ii);
+                m_free_values.push_back(slot);
+                return true;
+            }
+        }
+        return false;
     }
+
+    for(uint ii = 0; ii < m_nodes[node].count; ii++){
+        if(!child_bounds(node, ii).overlap(bounds)) continue;
+        uint32_t child = m_nodes[node].child[ii];
+        if(!remove_entry(child, bounds, value, orphans)) continue;
+
+        // Drop a child that doesn't have enough entries left, its values
+        // are put back in from the top
+        if(m_nodes[child].count < MinChildren){
+            gather(child, orphans);
+            free_subtree(child);
+            remove_child(node, ii);
+        } else {
+            set_child(node, ii, node_bounds(child), child);
+        }
+        return true;
+    }
+    return false;
 }
 
 RTREE_TEMPLATE
-uint RTREENODE_CLASS::real_size() const {
-    if(m_internal){
-        uint value = 0;
-        for(auto child : m_children)
-            value += child->real_size();
-        return value;
+void RTREE_CLASS::gather(uint32_t node, std::vector<Entry>& output) const {
+    if(m_nodes[node].leaf){
+        for(uint ii = 0; ii < m_nodes[node].count; ii++)
+            output.emplace_back(child_bounds(node, ii), m_nodes[node].child[ii]);
     } else {
-        return m_data.size();
+        for(uint ii = 0; ii < m_nodes[node].count; ii++)
+            gather(m_nodes[node].child[ii], output);
     }
 }
 
 RTREE_TEMPLATE
-int64_t RTREENODE_CLASS::expansion(Volume bounds) const {
-    return ((bounds | m_bounds) - m_bounds).volume();
+int64_t RTREE_CLASS::size(Volume volume){
+    return int64_t(volume.size.x) * volume.size.y * volume.size.z;
 }
 
 RTREE_TEMPLATE
-auto RTREENODE_CLASS::split_self() -> NodeType* {
-    // Which axis are we splitting on
-    int axis = 0;
-    uint axis_size = m_bounds.size[0];
-    for(int ii = 1; ii < Dimensions; ii++){
-        if(axis_size < m_bounds.size[ii]){
-            axis = ii;
-            axis_size = m_bounds.size[ii];
+uint RTREE_CLASS::choose_child(uint32_t node, Volume bounds) const {
+    // See which of the child nodes will expand the least to include the
+    // new value. For R* the children of the lowest nodes are first
+    // compared by how much more they would overlap their siblings.
+    auto& item = m_nodes[node];
+    const bool overlap = star && m_nodes[item.child[0]].leaf;
+    Volume children[capacity];
+    for(uint ii = 0; ii < item.count; ii++)
+        children[ii] = child_bounds(node, ii);
+
+    auto overlap_expansion = [&](uint index){
+        auto grown = children[index] | bounds;
+        int64_t total = 0;
+        for(uint ii = 0; ii < item.count; ii++){
+            if(ii == index) continue;
+            if(grown.overlap(children[ii]))
+                total += size(grown & children[ii]);
+            if(children[index].overlap(children[ii]))
+                total -= size(children[index] & children[ii]);
+        }
+        return total;
+    };
+
+    uint candidate = 0;
+    int64_t overlap_growth = 0;
+    int64_t expansion = 0;
+    uint occupancy = 0;
+    for(uint ii = 0; ii < item.count; ii++){
+        int64_t child_overlap = overlap ? overlap_expansion(ii) : 0;
+        int64_t child_expansion = size(bounds | children[ii]) - size(children[ii]);
+        uint child_occupancy = m_nodes[item.child[ii]].count;
+        bool better = ii == 0 || child_overlap < overlap_growth;
+        if(!better && child_overlap == overlap_growth){
+            // Break ties in expansion with occupancy
+            better = child_expansion < expansion
+                || (child_expansion == expansion && child_occupancy < occupancy);
+        }
+        if(better){
+            candidate = ii;
+            overlap_growth = child_overlap;
+            expansion = child_expansion;
+            occupancy = child_occupancy;
         }
     }
+    return candidate;
+}
 
-    if(m_internal){
-        // Find a median value on that axis
-        std::vector<float> centers;
-        for(auto child : m_children) centers.push_back(child->m_bounds.center(axis));
-        float median = centers[centers.size()/2];
-
-        // We are going to divide the children into groups
-        decltype(m_children) left_group, right_group;
-        for(auto child : m_children){
-            if(child->m_bounds.center(axis) < median){
-                left_group.push_back(child);
-            } else {
-                right_group.push_back(child);
-            }
+RTREE_TEMPLATE
+void RTREE_CLASS::evict(uint32_t node, std::vector<Entry>& evicted){
+    auto center = node_bounds(node);
+    auto distance = [&](Volume volume){
+        float total = 0;
+        for(int ii = 0; ii < Dimensions; ii++){
+            float gap = volume.center(ii) - center.center(ii);
+            total += gap * gap;
         }
+        return total;
+    };
+    auto items = entries(node);
+    std::stable_sort(items.begin(), items.end(), [&](const Entry& a, const Entry& b){
+        return distance(a.first) > distance(b.first);
+    });
+
+    // About 30% of a full node
+    const size_t count = std::max(1, (MaxChildren + 1) * 3 / 10);
+    evicted.assign(items.begin(), items.begin() + count);
+    set_entries(node, std::vector<Entry>(items.begin() + count, items.end()));
+}
 
-        m_children = left_group;
-        update_bounds();
-        return new NodeType(right_group);
+RTREE_TEMPLATE
+uint32_t RTREE_CLASS::split(uint32_t node){
+    auto items = entries(node);
+    size_t middle;
 
+    if(star){
+        middle = star_split(items);
     } else {
-        // Find a median value on that axis
-        std::vector<float> centers;
-        for(auto child : m_data) centers.push_back(child.first.center(axis));
-        float median = centers[centers.size()/2];
-
-        // We are going to divide the children into groups
-        decltype(m_data) left_group, right_group;
-        for(auto child : m_data){
-            if(child.first.center(axis) < median){
-                left_group.push_back(child);
-            } else {
-                right_group.push_back(child);
-            }
-        }
-
-        m_data = left_group;
-        update_bounds();
-        return new NodeType(right_group);
+        // Split the longest axis at the median, by position so neither
+        // half is left empty when many of the centers are the same
+        auto bounds = node_bounds(node);
+        int axis = 0;
+        for(int ii = 1; ii < Dimensions; ii++)
+            if(bounds.size[axis] < bounds.size[ii]) axis = ii;
+
+        middle = items.size() / 2;
+        std::nth_element(items.begin(), items.begin() + middle, items.end(), [axis](const Entry& a, const Entry& b){
+            return a.first.center(axis) < b.first.center(axis);
+        });
     }
+
+    uint32_t other = new_node(m_nodes[node].leaf);
+    set_entries(node, std::vector<Entry>(items.begin(), items.begin() + middle));
+    set_entries(other, std::vector<Entry>(items.begin() + middle, items.end()));
+    return other;
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::absorb_child(NodeType* child){
-    // if a branch doesn't have enough values
-    if(child->real_size() < MinChildren){
-        // Take the data
-        decltype(m_data) data;
-        child->all(data);
-
-        // remove the child
-        {
-            auto iter = std::find(m_children.begin(), m_children.end(), child);
-            std::iter_swap(iter, m_children.rbegin());
-            m_children.pop_back();
-            delete child;
-            child = nullptr;
+size_t RTREE_CLASS::star_split(std::vector<Entry>& items){
+    const size_t count = items.size();
+    const size_t least = std::min<size_t>(MinChildren, count / 2);
+    std::vector<Volume> before(count), after(count);
+
+    // Sort by the low or high edge on an axis, and find the bounds of
+    // the first and last items for each split point
+    auto arrange = [&](int axis, bool high){
+        std::stable_sort(items.begin(), items.end(), [&](const Entry& a, const Entry& b){
+            if(high)
+                return a.first.offset[axis] + a.first.size[axis] < b.first.offset[axis] + b.first.size[axis];
+            return a.first.offset[axis] < b.first.offset[axis];
+        });
+        before[0] = items[0].first;
+        for(size_t ii = 1; ii < count; ii++)
+            before[ii] = before[ii - 1] | items[ii].first;
+        after[count - 1] = items[count - 1].first;
+        for(size_t ii = count - 1; ii > 0; ii--)
+            after[ii - 1] = after[ii] | items[ii - 1].first;
+    };
+    auto margin = [](Volume volume){
+        double total = 0;
+        for(int ii = 0; ii < Dimensions; ii++)
+            total += volume.size[ii];
+        return total;
+    };
+
+    // Pick the sorting with the least total margin over all the splits
+    int best_axis = 0;
+    bool best_high = false;
+    double best_margin = std::numeric_limits<double>::infinity();
+    for(int axis = 0; axis < Dimensions; axis++){
+        for(bool high : {false, true}){
+            arrange(axis, high);
+            double total = 0;
+            for(size_t split = least; split <= count - least; split++)
+                total += margin(before[split - 1]) + margin(after[split]);
+            if(total < best_margin){
+                best_margin = total;
+                best_axis = axis;
+                best_high = high;
+            }
         }
+    }
 
-        // Re-insert the data
-        for(auto item : data){
-            insert(item.second, item.first);
+    // Then the split with the least overlap, and then the least volume
+    arrange(best_axis, best_high);
+    size_t best = least;
+    double best_overlap = std::numeric_limits<double>::infinity();
+    double best_volume = best_overlap;
+    for(size_t split = least; split <= count - least; split++){
+        auto left = before[split - 1], right = after[split];
+        double overlap = left.overlap(right) ? (left & right).volume() : 0;
+        double volume = double(left.volume()) + right.volume();
+        if(overlap < best_overlap || (overlap == best_overlap && volume < best_volume)){
+            best = split;
+            best_overlap = overlap;
+            best_volume = volume;
         }
     }
-    // TODO add someting for rebalancing when internal nodes get sparse
-    // or list like.
+    return best;
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::split_child(NodeType* child){
-    if(child->size() > MaxChildren){
-        auto new_child = child->split_self();
-        m_children.push_back(new_child);
-        update_bounds();
-    }
+void RTREE_CLASS::tile(std::vector<Entry>& items, size_t begin, size_t end, int axis){
+    std::sort(items.begin() + begin, items.begin() + end, [&](const Entry& a, const Entry& b){
+        return a.first.center(axis) < b.first.center(axis);
+    });
+    if(axis + 1 >= Dimensions || end - begin <= MaxChildren) return;
+
+    // Cut into slabs holding a whole number of nodes, about the same
+    // number of slabs on each remaining axis
+    size_t nodes = (end - begin + MaxChildren - 1) / MaxChildren;
+    size_t slabs = std::ceil(std::pow(double(nodes), 1.0 / (Dimensions - axis)));
+    size_t slab = (nodes + slabs - 1) / slabs * MaxChildren;
+    for(size_t start = begin; start < end; start += slab)
+        tile(items, start, std::min(start + slab, end), axis + 1);
 }
 
 RTREE_TEMPLATE
-void RTREENODE_CLASS::update_bounds(){
-    if(m_internal){
-        m_bounds = m_children.front()->m_bounds;
-        for(uint ii = 1; ii < m_children.size(); ii++){
-            m_bounds = m_bounds | m_children[ii]->m_bounds;
-        }
-    } else {
-        m_bounds = m_data.front().first;
-        for(uint ii = 1; ii < m_data.size(); ii++){
-            m_bounds = m_bounds | m_data[ii].first;
-        }
+std::vector<std::pair<size_t, size_t>> RTREE_CLASS::pack(size_t count){
+    std::vector<std::pair<size_t, size_t>> groups;
+    for(size_t start = 0; start < count; start += MaxChildren)
+        groups.emplace_back(start, std::min(start + MaxChildren, count));
+
+    // Share the last two groups if the last is short
+    if(groups.size() > 1 && groups.back().second - groups.back().first < MinChildren){
+        auto& previous = groups[groups.size() - 2];
+        size_t middle = (previous.first + count + 1) / 2;
+        previous.second = middle;
+        groups.back().first = middle;
     }
+    return groups;
 }
 
 #undef RTREE_TEMPLATE
@@ -0,0 +1,96 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(uint threads) : m_next(0) {
+    start(threads);
+}
+
+ThreadPool::~ThreadPool(){
+    stop();
+}
+
+uint ThreadPool::size() const {
+    return m_threads.size() + 1;
+}
+
+void ThreadPool::resize(uint threads){
+    if(threads == size()) return;
+    stop();
+    start(threads);
+}
+
+void ThreadPool::run(uint count, const Task& task){
+    if(count == 0) return;
+
+    // Not worth waking anyone up
+    if(m_threads.empty() || count == 1){
+        task(0, count);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_count = count;
+        // Several blocks per thread so uneven work can even out
+        m_block = std::max(1u, count/(4 * size()));
+        m_next = 0;
+        m_busy = m_threads.size();
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    // Help out, then wait for the stragglers
+    process();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_busy == 0; });
+    m_task = nullptr;
+}
+
+void ThreadPool::worker(uint seen){
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]{ return m_stopping || m_generation != seen; });
+            if(m_stopping) return;
+            seen = m_generation;
+        }
+
+        process();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if(--m_busy == 0)
+            m_done.notify_one();
+    }
+}
+
+void ThreadPool::process(){
+    while(true){
+        uint begin = m_next.fetch_add(m_block);
+        if(begin >= m_count) break;
+        (*m_task)(begin, std::min(begin + m_block, m_count));
+    }
+}
+
+void ThreadPool::start(uint threads){
+    m_stopping = false;
+    for(uint ii = 1; ii < threads; ii++)
+        m_threads.emplace_back(&ThreadPool::worker, this, m_generation);
+}
+
+void ThreadPool::stop(){
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for(auto& thread : m_threads)
+        thread.join();
+    m_threads.clear();
+}
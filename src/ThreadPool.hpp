@@ -0,0 +1,73 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#ifndef HPPB_SRC_THREADPOOL_HPP
+#define HPPB_SRC_THREADPOOL_HPP
+
+#include "definitions.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A minimal pool of worker threads for running data parallel loops.
+ *
+ * The calling thread takes part in the work, so a pool of size one has no
+ * worker threads and runs everything inline.
+ */
+class ThreadPool {
+public:
+    // A task is called on a sub range [begin, end) of the full range
+    typedef std::function<void(uint, uint)> Task;
+
+public:
+    // Construct/Destruct
+    ThreadPool(uint threads = 1);
+    ~ThreadPool();
+
+public:
+    // How many threads (including the caller) share the work
+    uint size() const;
+    // Change the number of threads
+    void resize(uint);
+
+    // Run a task over the range [0, count), returning once it is done
+    void run(uint count, const Task&);
+
+protected:
+    // Loop run by each of the worker threads, starting from the
+    // last task generation it should ignore
+    void worker(uint);
+    // Take blocks of the current task until it is empty
+    void process();
+
+    void start(uint);
+    void stop();
+
+protected:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    // The task currently being run, and how it is being broken up
+    const Task * m_task = nullptr;
+    uint m_count = 0;
+    uint m_block = 1;
+    std::atomic<uint> m_next;
+
+    // Workers watch the generation to see when a new task is posted
+    uint m_generation = 0;
+    uint m_busy = 0;
+    bool m_stopping = false;
+};
+
+#endif
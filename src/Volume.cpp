@@ -56,6 +56,14 @@ Volume::operator bool () const {
     return !(size.x == 0 and size.y == 0 and size.z == 0);
 }
 
+bool Volume::operator == (Volume o) const {
+    return offset == o.offset && size == o.size;
+}
+
+bool Volume::operator != (Volume o) const {
+    return !(*this == o);
+}
+
 //
 //  Set operations on blocks of space
 //
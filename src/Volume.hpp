@@ -50,6 +50,11 @@ struct Volume {
     // surface area AND volume
     operator bool () const;
 
+    // Compare the exact extent, without this the conversion to
+    // bool would be used and any two non-empty volumes would match
+    bool operator == (Volume) const;
+    bool operator != (Volume) const;
+
     // parts of this not intersecting other
     Cluster operator - (Volume) const;
 
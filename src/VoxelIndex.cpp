@@ -0,0 +1,126 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#include "VoxelIndex.hpp"
+
+#include <algorithm>
+
+constexpr int VoxelIndex::chunk_bits;
+constexpr int VoxelIndex::chunk_size;
+constexpr int VoxelIndex::chunk_cells;
+
+uint32_t VoxelIndex::get(Point point) const {
+    auto found = m_chunks.find(key(point.x >> chunk_bits, point.y >> chunk_bits, point.z >> chunk_bits));
+    if(found == m_chunks.end()) return 0;
+    if(!found->second.cells) return found->second.uniform;
+    return found->second.cells[cell(point.x, point.y, point.z)];
+}
+
+void VoxelIndex::get(const Point* points, size_t count, uint32_t* out) const {
+    // Remember the last chunk, so runs of points in one chunk skip the hash
+    uint64_t last_key = 0;
+    const Chunk* last = nullptr;
+    bool known = false;
+
+    for(size_t ii = 0; ii < count; ii++){
+        auto point = points[ii];
+        uint64_t index = key(point.x >> chunk_bits, point.y >> chunk_bits, point.z >> chunk_bits);
+        if(!known || index != last_key){
+            auto found = m_chunks.find(index);
+            last = found == m_chunks.end() ? nullptr : &found->second;
+            last_key = index;
+            known = true;
+        }
+
+        if(!last) out[ii] = 0;
+        else if(!last->cells) out[ii] = last->uniform;
+        else out[ii] = last->cells[cell(point.x, point.y, point.z)];
+    }
+}
+
+void VoxelIndex::fill(Volume volume, uint32_t id){
+    if(volume.volume() == 0) return;
+
+    // Visit every chunk the volume touches, shifting rounds down for negatives
+    for(int cx = volume.xmin() >> chunk_bits; cx <= volume.xmax() >> chunk_bits; cx++)
+    for(int cy = volume.ymin() >> chunk_bits; cy <= volume.ymax() >> chunk_bits; cy++)
+    for(int cz = volume.zmin() >> chunk_bits; cz <= volume.zmax() >> chunk_bits; cz++){
+        Volume bounds(Point(cx * chunk_size, cy * chunk_size, cz * chunk_size), Size(chunk_size, chunk_size, chunk_size));
+        Volume covered = bounds & volume;
+        uint64_t index = key(cx, cy, cz);
+
+        // Covering the whole chunk just replaces it
+        if(covered.volume() == chunk_cells){
+            if(id == 0){
+                m_chunks.erase(index);
+            } else {
+                auto& chunk = m_chunks[index];
+                chunk.uniform = id;
+                chunk.cells.reset();
+            }
+            continue;
+        }
+
+        auto found = m_chunks.find(index);
+        if(found == m_chunks.end()){
+            if(id == 0) continue;
+            found = m_chunks.emplace(index, Chunk()).first;
+        }
+        auto& chunk = found->second;
+        if(!chunk.cells){
+            if(chunk.uniform == id) continue;
+            chunk.cells.reset(new uint32_t[chunk_cells]);
+            std::fill(chunk.cells.get(), chunk.cells.get() + chunk_cells, chunk.uniform);
+        }
+
+        for(int xx = covered.xmin(); xx <= covered.xmax(); xx++)
+        for(int yy = covered.ymin(); yy <= covered.ymax(); yy++)
+        for(int zz = covered.zmin(); zz <= covered.zmax(); zz++)
+            chunk.cells[cell(xx, yy, zz)] = id;
+
+        collapse(index, chunk);
+    }
+}
+
+void VoxelIndex::clear(){
+    m_chunks.clear();
+}
+
+size_t VoxelIndex::chunks() const {
+    return m_chunks.size();
+}
+
+size_t VoxelIndex::dense_chunks() const {
+    size_t count = 0;
+    for(auto& chunk : m_chunks)
+        if(chunk.second.cells) count++;
+    return count;
+}
+
+uint64_t VoxelIndex::key(int x, int y, int z){
+    // 21 bits for each axis
+    const uint64_t mask = (1u << 21) - 1;
+    return (uint64_t(x) & mask) << 42 | (uint64_t(y) & mask) << 21 | (uint64_t(z) & mask);
+}
+
+uint VoxelIndex::cell(int x, int y, int z){
+    const int mask = chunk_size - 1;
+    return ((x & mask) << chunk_bits | (y & mask)) << chunk_bits | (z & mask);
+}
+
+void VoxelIndex::collapse(uint64_t index, Chunk& chunk){
+    uint32_t first = chunk.cells[0];
+    if(!std::all_of(chunk.cells.get(), chunk.cells.get() + chunk_cells, [&](uint32_t id){ return id == first; }))
+        return;
+
+    if(first == 0){
+        m_chunks.erase(index);
+    } else {
+        chunk.uniform = first;
+        chunk.cells.reset();
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#ifndef HPPB_SRC_VOXELINDEX_HPP
+#define HPPB_SRC_VOXELINDEX_HPP
+
+#include "definitions.hpp"
+#include "Volume.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+/**
+ * A dense map from each integer point in space to a 32 bit id, zero
+ * meaning nothing is there.
+ *
+ * Space is broken into cubic chunks, which only exist where there is
+ * something. A chunk holding a single id throughout doesn't store its
+ * cells, so large open areas stay cheap. Looking up a point is one hash
+ * lookup and at most one more read.
+ */
+class VoxelIndex {
+public:
+    // Chunks are 16 cells on a side
+    static constexpr int chunk_bits = 4;
+    static constexpr int chunk_size = 1 << chunk_bits;
+    static constexpr int chunk_cells = chunk_size * chunk_size * chunk_size;
+
+public:
+    // Find the id at a point
+    uint32_t get(Point) const;
+    // Find the ids at many points, faster when points near each other
+    // are next to each other in the list
+    void get(const Point*, size_t, uint32_t*) const;
+    // Set every point of a volume to an id
+    void fill(Volume, uint32_t);
+    // Remove everything
+    void clear();
+
+    // How many chunks exist, and how many of those store their cells
+    size_t chunks() const;
+    size_t dense_chunks() const;
+
+protected:
+    struct Chunk {
+        uint32_t uniform = 0;
+        std::unique_ptr<uint32_t[]> cells;
+    };
+
+    // Key for the chunk with the given chunk coordinates
+    static uint64_t key(int, int, int);
+    // Position of a point within its chunk
+    static uint cell(int, int, int);
+    // If a chunk's cells are all the same, stop storing them
+    void collapse(uint64_t, Chunk&);
+
+protected:
+    std::unordered_map<uint64_t, Chunk> m_chunks;
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#include "flux.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HPPB_FLUX_X86
+#include <immintrin.h>
+#endif
+
+//
+// Helper functions that are limited to this module.
+//
+namespace {
+    // Process the edges [begin, end) of the batch one at a time.
+    //
+    // The vector versions below must do exactly the same operations
+    // in the same order, so that the results match.
+    void flux_scalar(const FluxBatch& batch, uint begin, uint end, float delta_time){
+        for(uint ii = begin; ii < end; ii++){
+            if(batch.open[ii] == 0){
+                batch.mass[ii] = 0;
+                batch.new_acceleration[ii] = 0;
+                batch.new_velocity[ii] = 0;
+                continue;
+            }
+
+            float pressure_gradient = (batch.density_b[ii] * batch.pressure_scale
+                - batch.density_a[ii] * batch.pressure_scale) / flow_distance;
+
+            // Divide by density to get the presure contribution to flow acceleration
+            float density = (batch.density_a[ii] + batch.density_b[ii]) * 0.5f;
+            float new_flow_acceleration = pressure_gradient / density;
+
+            // Get the average acceleration in the period between the last update
+            // and this one
+            float current_flow_acceleration = (batch.acceleration[ii] + new_flow_acceleration) * 0.5f;
+
+            // Calculate a velocity and flow
+            float velocity = batch.velocity[ii];
+            float flow_velocity = current_flow_acceleration * delta_time + velocity * 0.5f;
+            float volumetric_flow = (flow_velocity + velocity) * 0.5f * batch.surface[ii];
+
+            // Convert to mass
+            batch.mass[ii] = volumetric_flow * density * delta_time;
+            batch.new_acceleration[ii] = new_flow_acceleration;
+            batch.new_velocity[ii] = flow_velocity;
+        }
+    }
+
+#ifdef HPPB_FLUX_X86
+    // Four edges at a time
+    __attribute__((target("sse2")))
+    void flux_sse2(const FluxBatch& batch, uint begin, uint end, float delta_time){
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 scale = _mm_set1_ps(batch.pressure_scale);
+        const __m128 distance = _mm_set1_ps(flow_distance);
+        const __m128 delta = _mm_set1_ps(delta_time);
+
+        uint ii = begin;
+        for(; ii + 4 <= end; ii += 4){
+            __m128 open = _mm_cmpneq_ps(_mm_loadu_ps(batch.open + ii), zero);
+            __m128 density_a = _mm_loadu_ps(batch.density_a + ii);
+            __m128 density_b = _mm_loadu_ps(batch.density_b + ii);
+            __m128 acceleration = _mm_loadu_ps(batch.acceleration + ii);
+            __m128 velocity = _mm_loadu_ps(batch.velocity + ii);
+            __m128 surface = _mm_loadu_ps(batch.surface + ii);
+
+            __m128 pressure_gradient = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(density_b, scale), _mm_mul_ps(density_a, scale)), distance);
+            __m128 density = _mm_mul_ps(_mm_add_ps(density_a, density_b), half);
+            __m128 new_flow_acceleration = _mm_div_ps(pressure_gradient, density);
+            __m128 current_flow_acceleration = _mm_mul_ps(_mm_add_ps(acceleration, new_flow_acceleration), half);
+            __m128 flow_velocity = _mm_add_ps(_mm_mul_ps(current_flow_acceleration, delta), _mm_mul_ps(velocity, half));
+            __m128 volumetric_flow = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(flow_velocity, velocity), half), surface);
+            __m128 mass = _mm_mul_ps(_mm_mul_ps(volumetric_flow, density), delta);
+
+            // Closed edges may have produced garbage, mask it out
+            _mm_storeu_ps(batch.mass + ii, _mm_and_ps(mass, open));
+            _mm_storeu_ps(batch.new_acceleration + ii, _mm_and_ps(new_flow_acceleration, open));
+            _mm_storeu_ps(batch.new_velocity + ii, _mm_and_ps(flow_velocity, open));
+        }
+
+        flux_scalar(batch, ii, end, delta_time);
+    }
+
+    // Eight edges at a time
+    __attribute__((target("avx2")))
+    void flux_avx2(const FluxBatch& batch, uint begin, uint end, float delta_time){
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 scale = _mm256_set1_ps(batch.pressure_scale);
+        const __m256 distance = _mm256_set1_ps(flow_distance);
+        const __m256 delta = _mm256_set1_ps(delta_time);
+
+        uint ii = begin;
+        for(; ii + 8 <= end; ii += 8){
+            __m256 open = _mm256_cmp_ps(_mm256_loadu_ps(batch.open + ii), zero, _CMP_NEQ_UQ);
+            __m256 density_a = _mm256_loadu_ps(batch.density_a + ii);
+            __m256 density_b = _mm256_loadu_ps(batch.density_b + ii);
+            __m256 acceleration = _mm256_loadu_ps(batch.acceleration + ii);
+            __m256 velocity = _mm256_loadu_ps(batch.velocity + ii);
+            __m256 surface = _mm256_loadu_ps(batch.surface + ii);
+
+            __m256 pressure_gradient = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(density_b, scale), _mm256_mul_ps(density_a, scale)), distance);
+            __m256 density = _mm256_mul_ps(_mm256_add_ps(density_a, density_b), half);
+            __m256 new_flow_acceleration = _mm256_div_ps(pressure_gradient, density);
+            __m256 current_flow_acceleration = _mm256_mul_ps(_mm256_add_ps(acceleration, new_flow_acceleration), half);
+            __m256 flow_velocity = _mm256_add_ps(_mm256_mul_ps(current_flow_acceleration, delta), _mm256_mul_ps(velocity, half));
+            __m256 volumetric_flow = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(flow_velocity, velocity), half), surface);
+            __m256 mass = _mm256_mul_ps(_mm256_mul_ps(volumetric_flow, density), delta);
+
+            // Closed edges may have produced garbage, mask it out
+            _mm256_storeu_ps(batch.mass + ii, _mm256_and_ps(mass, open));
+            _mm256_storeu_ps(batch.new_acceleration + ii, _mm256_and_ps(new_flow_acceleration, open));
+            _mm256_storeu_ps(batch.new_velocity + ii, _mm256_and_ps(flow_velocity, open));
+        }
+
+        flux_sse2(batch, ii, end, delta_time);
+    }
+#endif
+
+    // The kernel in use, picked the first time it is needed
+    FluxKernel& current_kernel(){
+        static FluxKernel kernel = best_flux_kernel();
+        return kernel;
+    }
+}
+
+void flux(const FluxBatch& batch, uint count, float delta_time){
+    switch(current_kernel()){
+#ifdef HPPB_FLUX_X86
+    case FluxKernel::AVX2: flux_avx2(batch, 0, count, delta_time); break;
+    case FluxKernel::SSE2: flux_sse2(batch, 0, count, delta_time); break;
+#endif
+    default: flux_scalar(batch, 0, count, delta_time); break;
+    }
+}
+
+FluxKernel best_flux_kernel(){
+#ifdef HPPB_FLUX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return FluxKernel::AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return FluxKernel::SSE2;
+#endif
+    return FluxKernel::Scalar;
+}
+
+void select_flux_kernel(FluxKernel kernel){
+    current_kernel() = std::min(kernel, best_flux_kernel());
+}
+
+FluxKernel selected_flux_kernel(){
+    return current_kernel();
+}
@@ -0,0 +1,68 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+/**
+ * The flow calculation for a batch of edges of the gas graph.
+ *
+ * There are vectorized versions of the kernel for processors that support
+ * them, the best available one is picked when first used. All of the
+ * versions perform the same operations in the same order, so they give
+ * identical results.
+ */
+#ifndef HPPB_SRC_FLUX_HPP
+#define HPPB_SRC_FLUX_HPP
+
+#include "definitions.hpp"
+
+// Arrays describing a batch of edges from node 'a' to node 'b',
+// each with an entry per edge.
+struct FluxBatch {
+    // Density of gas on either side of the edge
+    const float * density_a;
+    const float * density_b;
+    // Non-zero when gas can move through the edge
+    const float * open;
+    // Area of the opening
+    const float * surface;
+    // The state of the flow through the edge at the last step
+    const float * acceleration;
+    const float * velocity;
+
+    // Output: the mass moving into node a (negative for out of) and the new
+    // state of the flow. These may point to the same arrays as the inputs.
+    float * mass;
+    float * new_acceleration;
+    float * new_velocity;
+
+    // Converts density to pressure
+    float pressure_scale;
+};
+
+// The distance the pressure difference across an edge acts over, used by
+// the flux kernel and by the implicit solve in GasGraph.
+// TODO I think this needs a distance component, possibly add the distance
+// from node's center of mass to each edge
+constexpr float flow_distance = 1.0f;
+
+// The versions of the kernel
+enum class FluxKernel {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// Calculate the flow through the first count edges of a batch
+void flux(const FluxBatch&, uint count, float delta_time);
+
+// The best kernel the current processor supports
+FluxKernel best_flux_kernel();
+// Change which kernel is used, limited to those that are supported
+void select_flux_kernel(FluxKernel);
+// The kernel currently in use
+FluxKernel selected_flux_kernel();
+
+#endif
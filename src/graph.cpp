@@ -18,26 +18,26 @@ int main(){
 
     GasGraph graph(0);
 
-    std::vector<GasGraph::Node*> nodes;
+    std::vector<GasGraph::Node> nodes;
 
     for(int ii = 0; ii < 10; ii++){
         auto node = graph.new_node();
         nodes.push_back(node);
-        node->volume = 1;
-        node->surface = 6;
+        graph.set_volume(node, 1);
+        graph.set_surface(node, 6);
     }
 
     for(uint ii = 0; ii < nodes.size() - 1; ii++){
         graph.set_edge(nodes[ii], nodes[ii + 1], 1);
     }
 
-    nodes[4]->gas_mass = 1;
+    graph.set_gas_mass(nodes[4], 1);
 
     int steps = 2*128;
     for(int ii = 0; ii < steps/2; ii++){
         std::cout.precision(3);
         for(auto& node : nodes)
-            std::cout << std::setw(10) << node->gas_mass;
+            std::cout << std::setw(10) << graph.gas_mass(node);
         std::cout << std::endl;
         // for(int jj = 0; jj < 10; jj++)
         graph.step(0.001);
@@ -45,10 +45,10 @@ int main(){
     }
 
     for(int ii = 0; ii < steps/2; ii++){
-        nodes[0]->gas_mass = 0;
+        graph.set_gas_mass(nodes[0], 0);
         std::cout.precision(3);
         for(auto& node : nodes)
-            std::cout << std::setw(10) << node->gas_mass;
+            std::cout << std::setw(10) << graph.gas_mass(node);
         std::cout << std::endl;
 
         // for(int jj = 0; jj < 10; jj++)
@@ -57,7 +57,7 @@ int main(){
     }
 
     float check = 0;
-    for(auto node : nodes) check += node->gas_mass;
+    for(auto node : nodes) check += graph.gas_mass(node);
 
     auto end = clock.now();
     std::chrono::duration<double> elapsed_seconds = end-start;
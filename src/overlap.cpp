@@ -0,0 +1,119 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+#include "overlap.hpp"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HPPB_OVERLAP_X86
+#include <immintrin.h>
+#endif
+
+//
+// Helper functions that are limited to this module.
+//
+namespace {
+    // Test the boxes [begin, end) one at a time
+    uint64_t overlap_scalar(const BoxRows& rows, uint begin, uint end, const int32_t * low, const int32_t * high){
+        uint64_t mask = 0;
+        for(uint ii = begin; ii < end; ii++){
+            bool overlap = true;
+            for(int axis = 0; axis < 3; axis++)
+                overlap = overlap && rows.low[axis][ii] < high[axis] && low[axis] < rows.high[axis][ii];
+            if(overlap) mask |= uint64_t(1) << ii;
+        }
+        return mask;
+    }
+
+#ifdef HPPB_OVERLAP_X86
+    // Four boxes at a time
+    __attribute__((target("sse2")))
+    uint64_t overlap_sse2(const BoxRows& rows, uint begin, uint end, const int32_t * low, const int32_t * high){
+        __m128i query_low[3], query_high[3];
+        for(int axis = 0; axis < 3; axis++){
+            query_low[axis] = _mm_set1_epi32(low[axis]);
+            query_high[axis] = _mm_set1_epi32(high[axis]);
+        }
+
+        uint64_t mask = 0;
+        uint ii = begin;
+        for(; ii + 4 <= end; ii += 4){
+            __m128i overlap = _mm_set1_epi32(-1);
+            for(int axis = 0; axis < 3; axis++){
+                __m128i box_low = _mm_loadu_si128((const __m128i*)(rows.low[axis] + ii));
+                __m128i box_high = _mm_loadu_si128((const __m128i*)(rows.high[axis] + ii));
+                overlap = _mm_and_si128(overlap, _mm_cmpgt_epi32(query_high[axis], box_low));
+                overlap = _mm_and_si128(overlap, _mm_cmpgt_epi32(box_high, query_low[axis]));
+            }
+            mask |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(overlap))) << ii;
+        }
+
+        return mask | overlap_scalar(rows, ii, end, low, high);
+    }
+
+    // Eight boxes at a time
+    __attribute__((target("avx2")))
+    uint64_t overlap_avx2(const BoxRows& rows, uint begin, uint end, const int32_t * low, const int32_t * high){
+        __m256i query_low[3], query_high[3];
+        for(int axis = 0; axis < 3; axis++){
+            query_low[axis] = _mm256_set1_epi32(low[axis]);
+            query_high[axis] = _mm256_set1_epi32(high[axis]);
+        }
+
+        uint64_t mask = 0;
+        uint ii = begin;
+        for(; ii + 8 <= end; ii += 8){
+            __m256i overlap = _mm256_set1_epi32(-1);
+            for(int axis = 0; axis < 3; axis++){
+                __m256i box_low = _mm256_loadu_si256((const __m256i*)(rows.low[axis] + ii));
+                __m256i box_high = _mm256_loadu_si256((const __m256i*)(rows.high[axis] + ii));
+                overlap = _mm256_and_si256(overlap, _mm256_cmpgt_epi32(query_high[axis], box_low));
+                overlap = _mm256_and_si256(overlap, _mm256_cmpgt_epi32(box_high, query_low[axis]));
+            }
+            mask |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(overlap))) << ii;
+        }
+
+        return mask | overlap_sse2(rows, ii, end, low, high);
+    }
+#endif
+
+    // The kernel in use, picked the first time it is needed
+    OverlapKernel& current_kernel(){
+        static OverlapKernel kernel = best_overlap_kernel();
+        return kernel;
+    }
+}
+
+uint64_t overlap_mask(const BoxRows& rows, uint count, const int32_t * low, const int32_t * high){
+    switch(current_kernel()){
+#ifdef HPPB_OVERLAP_X86
+    case OverlapKernel::AVX2: return overlap_avx2(rows, 0, count, low, high);
+    case OverlapKernel::SSE2: return overlap_sse2(rows, 0, count, low, high);
+#endif
+    default: return overlap_scalar(rows, 0, count, low, high);
+    }
+}
+
+OverlapKernel best_overlap_kernel(){
+#ifdef HPPB_OVERLAP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return OverlapKernel::AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return OverlapKernel::SSE2;
+#endif
+    return OverlapKernel::Scalar;
+}
+
+void select_overlap_kernel(OverlapKernel kernel){
+    current_kernel() = std::min(kernel, best_overlap_kernel());
+}
+
+OverlapKernel selected_overlap_kernel(){
+    return current_kernel();
+}
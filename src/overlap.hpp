@@ -0,0 +1,47 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright 2017 Adam Douglass
+ */
+/**
+ * Test a row of boxes against a query box, as used when searching the
+ * nodes of an RTree.
+ *
+ * As with the flux kernel there are vectorized versions for processors
+ * that support them, the best available one is picked when first used.
+ */
+#ifndef HPPB_SRC_OVERLAP_HPP
+#define HPPB_SRC_OVERLAP_HPP
+
+#include "definitions.hpp"
+
+#include <cstdint>
+
+// Boxes stored as arrays of their low corner and one past their high
+// corner, an array for each axis.
+struct BoxRows {
+    const int32_t * low[3];
+    const int32_t * high[3];
+};
+
+// The versions of the kernel
+enum class OverlapKernel {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// Find which of the first count boxes (at most 64) overlap the query box,
+// given the same way. Bit ii of the result is set if box ii overlaps.
+uint64_t overlap_mask(const BoxRows&, uint count, const int32_t * low, const int32_t * high);
+
+// The best kernel the current processor supports
+OverlapKernel best_overlap_kernel();
+// Change which kernel is used, limited to those that are supported
+void select_overlap_kernel(OverlapKernel);
+// The kernel currently in use
+OverlapKernel selected_overlap_kernel();
+
+#endif
@@ -10,6 +10,7 @@
 #include "Cluster.hpp"
 
 #include <fstream>
+#include <limits>
 #include <tuple>
 #include <algorithm>
 #include <unordered_map>
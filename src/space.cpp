@@ -24,18 +24,14 @@ int main(){
         std::cout  << space.air_at({20, 20, 20}) << " " << space.air_at({30, 20, 20}) << " " << space.air_at({75, 20, 20}) << std::endl;
     };
 
-    for(uint ii = 0; ii < 10; ii++){
-        space.step(0.1);
-    }
+    space.step_n(0.1, 10);
 
     print();
     space.add_air({1, 1, 1}, 1000000);
 
     print();
 
-    for(uint ii = 0; ii < 10; ii++){
-        space.step(0.1);
-    }
+    space.step_n(0.1, 10);
     print();
 
     std::cout << "-------------------" << std::endl;
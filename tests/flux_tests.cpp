@@ -0,0 +1,48 @@
+#include <random>
+
+#include "gtest/gtest.h"
+#include "flux.hpp"
+
+// Every supported kernel should give exactly the same result
+TEST(flux_tests, kernels_agree){
+    std::mt19937_64 prng(10);
+    std::uniform_real_distribution<float> unit(0, 1);
+
+    // An odd count so the vector kernels have a tail to finish
+    const uint count = 1001;
+    std::vector<float> density_a(count), density_b(count), open(count), surface(count);
+    std::vector<float> acceleration(count), velocity(count);
+    for(uint ii = 0; ii < count; ii++){
+        density_a[ii] = unit(prng);
+        density_b[ii] = unit(prng);
+        open[ii] = unit(prng) < 0.9 ? 1 : 0;
+        surface[ii] = 10 * unit(prng);
+        acceleration[ii] = unit(prng) - 0.5f;
+        velocity[ii] = unit(prng) - 0.5f;
+    }
+    // Closed edges can have values that would break the formula
+    density_a[3] = density_b[3] = open[3] = 0;
+
+    auto run = [&](FluxKernel kernel){
+        select_flux_kernel(kernel);
+        std::vector<float> mass(count), new_acceleration(count), new_velocity(count);
+        flux(FluxBatch{
+            density_a.data(), density_b.data(), open.data(), surface.data(),
+            acceleration.data(), velocity.data(),
+            mass.data(), new_acceleration.data(), new_velocity.data(),
+            287.0f * 293.15f
+        }, count, 0.01);
+        return std::make_tuple(mass, new_acceleration, new_velocity);
+    };
+
+    auto expected = run(FluxKernel::Scalar);
+    ASSERT_EQ(std::get<0>(expected)[3], 0);
+    ASSERT_NE(std::get<0>(expected)[0], 0);
+    for(auto kernel : {FluxKernel::SSE2, FluxKernel::AVX2}){
+        auto result = run(kernel);
+        ASSERT_EQ(std::get<0>(expected), std::get<0>(result));
+        ASSERT_EQ(std::get<1>(expected), std::get<1>(result));
+        ASSERT_EQ(std::get<2>(expected), std::get<2>(result));
+    }
+    select_flux_kernel(best_flux_kernel());
+}
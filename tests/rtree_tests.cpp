@@ -3,6 +3,7 @@
 #include "gtest/gtest.h"
 #include "Volume.hpp"
 #include "RTree.hpp"
+#include "overlap.hpp"
 
 std::vector<int> brute_force(const std::vector<Volume>& volumes, Volume bounds){
     std::vector<int> out;
@@ -86,3 +87,146 @@ TEST(rtree_tests, remove_against_brute_force){
         ASSERT_EQ(target, result);
     }
 }
+
+TEST(rtree_tests, bulk_load_against_brute_force){
+    // Get a long sequence of numbers
+    std::mt19937_64 prng(10);
+    std::uniform_int_distribution<> size_distribution(1, 100);
+    std::uniform_int_distribution<> offset_distribution(0, 1000);
+
+    // Construct an RTree and load it all at once
+    RTree<int> tree;
+    tree.insert(-1, Volume({0, 0, 0}, {1, 1, 1}));
+    std::vector<Volume> items;
+    std::vector<std::pair<Volume, int>> load;
+    for(int ii = 0; ii < 10000; ii++){
+        Volume current(
+            {offset_distribution(prng), offset_distribution(prng), offset_distribution(prng)},
+            {size_distribution(prng), size_distribution(prng), size_distribution(prng)}
+        );
+        items.push_back(current);
+        load.emplace_back(current, ii);
+    }
+    tree.bulk_load(load);
+    ASSERT_EQ(tree.find(10), items[10]);
+
+    // Keep editing it afterwards
+    size_t start = items.size();
+    while(items.size() > start/2){
+        tree.remove(items.size() - 1);
+        items.pop_back();
+    }
+    for(int ii = 0; ii < 1000; ii++){
+        Volume current(
+            {offset_distribution(prng), offset_distribution(prng), offset_distribution(prng)},
+            {size_distribution(prng), size_distribution(prng), size_distribution(prng)}
+        );
+        tree.insert(items.size(), current);
+        items.push_back(current);
+    }
+
+    // Perform some queries
+    for(int ii = 0; ii < 10000; ii++){
+        Volume search(
+            {offset_distribution(prng), offset_distribution(prng), offset_distribution(prng)},
+            {size_distribution(prng), size_distribution(prng), size_distribution(prng)}
+        );
+
+        auto target = brute_force(items, search);
+        auto result = tree.intersecting(search);
+        ASSERT_EQ(target.size(), result.size());
+        std::sort(result.begin(), result.end());
+        ASSERT_EQ(target, result);
+    }
+
+    // Small loads still make a usable tree
+    for(int count : {0, 1, 33, 35}){
+        std::vector<std::pair<Volume, int>> few(load.begin(), load.begin() + count);
+        tree.bulk_load(few);
+        ASSERT_EQ(tree.intersecting(Volume({0, 0, 0}, {2000, 2000, 2000})).size(), count);
+    }
+}
+
+TEST(rtree_tests, star_policy_against_brute_force){
+    // Get a long sequence of numbers
+    std::mt19937_64 prng(10);
+    std::uniform_int_distribution<> size_distribution(1, 100);
+    std::uniform_int_distribution<> offset_distribution(0, 1000);
+    auto random_volume = [&](){
+        return Volume(
+            {offset_distribution(prng), offset_distribution(prng), offset_distribution(prng)},
+            {size_distribution(prng), size_distribution(prng), size_distribution(prng)}
+        );
+    };
+
+    // Construct an R* tree and load it with volumes
+    RTree<int, 3, 4, 32, RTreeStar> tree;
+    std::vector<Volume> items;
+    for(int ii = 0; ii < 10000; ii++){
+        items.push_back(random_volume());
+        tree.insert(ii, items.back());
+    }
+
+    // Move some of them and remove others
+    for(int ii = 0; ii < 2000; ii++){
+        items[ii] = random_volume();
+        tree.move(ii, items[ii]);
+    }
+    size_t start = items.size();
+    while(items.size() > start/2){
+        tree.remove(items.size() - 1);
+        items.pop_back();
+    }
+
+    // Perform some queries
+    for(int ii = 0; ii < 10000; ii++){
+        auto search = random_volume();
+        auto target = brute_force(items, search);
+        auto result = tree.intersecting(search);
+        ASSERT_EQ(target.size(), result.size());
+        std::sort(result.begin(), result.end());
+        ASSERT_EQ(target, result);
+    }
+}
+
+// Every supported overlap kernel should find the same boxes
+TEST(rtree_tests, overlap_kernels_agree){
+    std::mt19937_64 prng(10);
+    std::uniform_int_distribution<> size_distribution(1, 100);
+    std::uniform_int_distribution<> offset_distribution(-500, 500);
+
+    // An odd count so the vector kernels have a tail to finish
+    const uint count = 61;
+    std::vector<int32_t> low[3], high[3];
+    for(int axis = 0; axis < 3; axis++){
+        for(uint ii = 0; ii < count; ii++){
+            low[axis].push_back(offset_distribution(prng));
+            high[axis].push_back(low[axis].back() + size_distribution(prng));
+        }
+    }
+    BoxRows rows{{low[0].data(), low[1].data(), low[2].data()}, {high[0].data(), high[1].data(), high[2].data()}};
+
+    for(int ii = 0; ii < 1000; ii++){
+        int32_t query_low[3], query_high[3];
+        for(int axis = 0; axis < 3; axis++){
+            query_low[axis] = offset_distribution(prng);
+            query_high[axis] = query_low[axis] + size_distribution(prng);
+        }
+
+        // Compare against the volumes the boxes stand for
+        Volume query({query_low[0], query_low[1], query_low[2]},
+                     {query_high[0] - query_low[0], query_high[1] - query_low[1], query_high[2] - query_low[2]});
+        uint64_t expected = 0;
+        for(uint box = 0; box < count; box++){
+            Volume volume({low[0][box], low[1][box], low[2][box]},
+                          {high[0][box] - low[0][box], high[1][box] - low[1][box], high[2][box] - low[2][box]});
+            if(volume.overlap(query)) expected |= uint64_t(1) << box;
+        }
+
+        for(auto kernel : {OverlapKernel::Scalar, OverlapKernel::SSE2, OverlapKernel::AVX2}){
+            select_overlap_kernel(kernel);
+            ASSERT_EQ(overlap_mask(rows, count, query_low, query_high), expected);
+        }
+    }
+    select_overlap_kernel(best_overlap_kernel());
+}
@@ -0,0 +1,526 @@
+#include <random>
+#include <algorithm>
+#include <set>
+#include <tuple>
+
+#include "gtest/gtest.h"
+
+#include "GasSpace.hpp"
+#include "AsyncGasSpace.hpp"
+
+// Expose the sectors of a space for checking
+struct SpaceProbe : public GasSpace {
+    SpaceProbe() : GasSpace(0) {}
+    using GasSpace::find_sector;
+    using GasSpace::expand;
+    using GasSpace::overlapping_sectors;
+    using GasSpace::clear_volume;
+    using GasSpace::block_cluster;
+    using GasSpace::score_addition;
+
+    void clear_score_cache(){
+        m_score_cache.clear();
+    }
+
+    const std::vector<Sector*>& sectors() const {
+        return m_sector_list;
+    }
+
+    const GasGraph& graph() const {
+        return m_graph;
+    }
+
+    const Source& source(uint id) const {
+        return m_sources[id];
+    }
+
+    float total_volume() const {
+        float total = 0;
+        for(auto sector : m_sector_list)
+            total += sector->parts.volume();
+        return total;
+    }
+};
+
+TEST(space_tests, edits_apply_on_commit){
+    SpaceProbe space;
+    space.clear(Volume({0, 0, 0}, {20, 10, 10}));
+    ASSERT_EQ(space.total_volume(), 2000);
+
+    // Build a wall one cell at a time, then knock a hole back in it
+    space.begin_edit();
+    for(int yy = 0; yy < 10; yy++)
+        for(int zz = 0; zz < 10; zz++)
+            space.block(Volume({10, yy, zz}));
+    space.clear(Volume({10, 5, 5}));
+    ASSERT_EQ(space.total_volume(), 2000);
+    space.commit();
+
+    ASSERT_EQ(space.total_volume(), 1901);
+    ASSERT_EQ(space.air_at({10, 5, 5}), 0);
+
+    // Gas still gets through the hole
+    space.add_air({0, 0, 0}, 1000);
+    space.step_n(0.01, 200);
+    ASSERT_GT(space.air_at({19, 9, 9}), 0);
+}
+
+TEST(space_tests, lazy_partition_waits_for_maintain){
+    SpaceProbe eager, lazy;
+    lazy.set_lazy_partition(true);
+
+    // Cut an L shape out of a slab, which is worth splitting
+    for(auto space : {&eager, &lazy}){
+        space->clear(Volume({0, 0, 0}, {20, 20, 2}));
+        space->block(Volume({5, 5, 0}, {15, 15, 2}));
+        ASSERT_EQ(space->total_volume(), 175 * 2);
+    }
+    ASSERT_GT(eager.size(), 1);
+    ASSERT_EQ(lazy.size(), 1);
+
+    // No time means no work
+    ASSERT_EQ(lazy.maintain(0), 1);
+    ASSERT_EQ(lazy.size(), 1);
+
+    ASSERT_EQ(lazy.maintain(1000000), 0);
+    ASSERT_EQ(lazy.size(), eager.size());
+    ASSERT_EQ(lazy.total_volume(), 175 * 2);
+}
+
+// Expose the simulation side of an async space for checking
+struct AsyncProbe : public AsyncGasSpace {
+    AsyncProbe() : AsyncGasSpace(0) {}
+
+    float total_mass() const {
+        float total = 0;
+        for(auto node : m_current->nodes)
+            total += m_current->graph->gas_mass(node);
+        return total;
+    }
+};
+
+TEST(space_tests, sleeping_is_opt_in){
+    SpaceProbe plain, sleepy;
+    sleepy.set_sleep_tolerance(1);
+    for(auto space : {&plain, &sleepy}){
+        space->clear(Volume({0, 0, 0}, {20, 20, 2}));
+        space->block(Volume({5, 5, 0}, {15, 15, 2}));
+        ASSERT_GT(space->size(), 1);
+        space->step_n(0.01, 20);
+    }
+
+    // Settled sectors only stop being stepped when asked to
+    ASSERT_EQ(plain.graph().awake_count(), plain.size());
+    ASSERT_EQ(sleepy.graph().awake_count(), 0);
+}
+
+TEST(space_tests, async_layouts_keep_gas){
+    AsyncProbe space;
+    space.clear(Volume({0, 0, 0}, {20, 10, 10}));
+    space.flush();
+    ASSERT_EQ(space.size(), 1);
+    space.add_air({0, 0, 0}, 2000);
+
+    // Stepping carries on while the worker is busy
+    for(int yy = 0; yy < 10; yy++)
+        for(int zz = 0; zz < 10; zz++)
+            space.block(Volume({10, yy, zz}));
+    space.clear(Volume({10, 5, 5}));
+    space.step_n(0.01, 10);
+    space.flush();
+
+    // The gas in the blocked cells is gone, the rest is spread over the
+    // new sectors at the same even density
+    ASSERT_GT(space.size(), 1);
+    ASSERT_NEAR(space.total_mass(), 1901, 1e-1);
+    ASSERT_EQ(space.air_at({10, 0, 0}), 0);
+    ASSERT_NEAR(space.air_at({19, 9, 9}), 1, 1e-3);
+}
+
+TEST(space_tests, block_trims_end_of_sector){
+    SpaceProbe space;
+    space.clear(Volume({0, 0, 0}, {10, 10, 1}));
+    ASSERT_EQ(space.size(), 1);
+
+    // Cutting off one end leaves the sector with as many parts as before
+    space.block(Volume({9, 0, 0}, {1, 10, 1}));
+    ASSERT_EQ(space.total_volume(), 90);
+    ASSERT_EQ(space.air_at({9, 5, 0}), 0);
+}
+
+TEST(space_tests, lookup_follows_growth){
+    SpaceProbe space;
+    space.clear(Volume({0, 0, 0}, {10, 10, 1}));
+    space.clear(Volume({10, 0, 0}, {5, 10, 1}));
+    ASSERT_EQ(space.size(), 1);
+
+    // The grown sector is found in its new space
+    ASSERT_NE(space.find_sector({12, 5, 0}), nullptr);
+    space.block(Volume({14, 0, 0}, {1, 10, 1}));
+    ASSERT_EQ(space.total_volume(), 140);
+}
+
+TEST(space_tests, clearing_never_shares_space){
+    SpaceProbe space;
+    std::mt19937_64 prng(0);
+    std::uniform_int_distribution<> position(0, 12);
+    std::uniform_int_distribution<> extent(1, 6);
+
+    // Overlapping clears leave every open cell in exactly one sector
+    std::set<std::tuple<int, int, int>> open;
+    for(int ii = 0; ii < 40; ii++){
+        Volume volume({position(prng), position(prng), position(prng) % 3},
+            {extent(prng), extent(prng), extent(prng) % 2 + 1});
+        space.clear(volume);
+        for(int xx = volume.xmin(); xx <= volume.xmax(); xx++)
+        for(int yy = volume.ymin(); yy <= volume.ymax(); yy++)
+        for(int zz = volume.zmin(); zz <= volume.zmax(); zz++)
+            open.emplace(xx, yy, zz);
+        ASSERT_EQ(space.total_volume(), open.size());
+    }
+}
+
+TEST(space_tests, expand_only_adds_new_space){
+    SpaceProbe space;
+    space.clear(Volume({0, 0, 0}, {10, 10, 1}));
+    auto sector = space.sectors().front();
+
+    space.expand(sector, Volume({5, 0, 0}, {10, 10, 1}));
+    ASSERT_EQ(space.total_volume(), 150);
+    space.expand(sector, Volume({0, 0, 0}, {4, 4, 1}));
+    ASSERT_EQ(space.total_volume(), 150);
+    ASSERT_EQ(sector->bounds(), Volume({0, 0, 0}, {15, 10, 1}));
+}
+
+TEST(space_tests, voxel_index_matches_parts){
+    SpaceProbe space;
+    space.set_voxel_index(true);
+    space.clear(Volume({0, 0, 0}, {20, 20, 2}));
+    space.block(Volume({5, 5, 0}, {15, 15, 2}));
+    space.clear(Volume({30, 0, 0}, {5, 5, 5}));
+
+    // Every point reads the sector whose parts actually hold it, including
+    // the inside corner of the L that only its bounds cover
+    for(int xx = -1; xx < 36; xx++)
+    for(int yy = -1; yy < 21; yy++)
+    for(int zz = -1; zz < 6; zz++){
+        Point point(xx, yy, zz);
+        auto sector = space.find_sector(point);
+        if(sector){
+            ASSERT_TRUE(sector->parts.overlap(Volume(point)));
+        } else {
+            for(auto other : space.sectors())
+                ASSERT_FALSE(other->parts.overlap(Volume(point)));
+        }
+    }
+}
+
+TEST(space_tests, batch_queries_match_single){
+    for(bool voxels : {false, true}){
+        SpaceProbe space;
+        space.set_voxel_index(voxels);
+        space.clear(Volume({0, 0, 0}, {20, 20, 4}));
+        space.block(Volume({5, 5, 0}, {15, 15, 4}));
+        space.clear(Volume({-8, -8, -8}, {6, 6, 6}));
+        space.add_air({0, 0, 0}, 100);
+        space.add_air({-5, -5, -5}, 30);
+
+        std::mt19937_64 prng(10);
+        std::uniform_int_distribution<> position(-10, 22);
+        std::vector<Point> points;
+        std::vector<float> values;
+        for(int ii = 0; ii < 2000; ii++){
+            points.emplace_back(position(prng), position(prng), position(prng) % 5);
+            values.push_back(0.5);
+        }
+
+        std::vector<float> air(points.size()), pressure(points.size());
+        space.air_at(points.data(), points.size(), air.data());
+        space.pressure_at(points.data(), points.size(), pressure.data());
+        for(uint ii = 0; ii < points.size(); ii++){
+            ASSERT_EQ(air[ii], space.air_at(points[ii]));
+            ASSERT_EQ(pressure[ii], space.pressure_at(points[ii]));
+        }
+
+        // Adding in a batch gives every sector the same total
+        SpaceProbe single;
+        single.set_voxel_index(voxels);
+        single.clear(Volume({0, 0, 0}, {20, 20, 4}));
+        single.block(Volume({5, 5, 0}, {15, 15, 4}));
+        single.clear(Volume({-8, -8, -8}, {6, 6, 6}));
+        single.add_air({0, 0, 0}, 100);
+        single.add_air({-5, -5, -5}, 30);
+        space.add_air(points.data(), values.data(), points.size());
+        for(uint ii = 0; ii < points.size(); ii++)
+            single.add_air(points[ii], values[ii]);
+        for(auto point : points)
+            ASSERT_FLOAT_EQ(space.air_at(point), single.air_at(point));
+    }
+}
+
+TEST(space_tests, portals_match_contact){
+    SpaceProbe space;
+    std::mt19937_64 prng(10);
+    std::uniform_int_distribution<> position(0, 16);
+    std::uniform_int_distribution<> extent(1, 6);
+
+    for(int ii = 0; ii < 150; ii++){
+        Volume volume({position(prng), position(prng), position(prng) % 4},
+            {extent(prng), extent(prng), extent(prng) % 3 + 1});
+        if(ii % 3 == 2){
+            space.block(volume);
+            for(auto sector : space.sectors())
+                ASSERT_FALSE(sector->parts.overlap(volume));
+        } else {
+            space.clear(volume);
+        }
+
+        // Sectors never share space, and the kept contact areas agree with
+        // working them out from scratch and with the edges in the graph
+        for(auto sector : space.sectors()){
+            for(auto other : space.sectors()){
+                if(other == sector) continue;
+                for(auto part : other->parts)
+                    ASSERT_FALSE(sector->parts.overlap(part));
+                float contact = sector->parts.contact(other->parts);
+                auto found = sector->portals.find(other);
+                if(contact == 0){
+                    ASSERT_EQ(found, sector->portals.end());
+                } else {
+                    ASSERT_NE(found, sector->portals.end());
+                    ASSERT_EQ(found->second, contact);
+                }
+            }
+
+            auto edges = space.graph().neighbours(sector->node);
+            ASSERT_EQ(edges.size(), sector->portals.size());
+            for(auto edge : edges){
+                auto other = std::find_if(space.sectors().begin(), space.sectors().end(), [&](decltype(space.sectors().front()) item){
+                    return item->node == edge.first;
+                });
+                ASSERT_NE(other, space.sectors().end());
+                ASSERT_EQ(edge.second, sector->portals[*other]);
+            }
+        }
+    }
+}
+
+TEST(space_tests, part_lookup_is_exact){
+    SpaceProbe space;
+    std::mt19937_64 prng(20);
+    std::uniform_int_distribution<> position(0, 16);
+    std::uniform_int_distribution<> extent(1, 6);
+
+    // A ring, whose bounds cover a hole with a separate room in it
+    space.clear(Volume({0, 0, 0}, {20, 20, 1}));
+    space.block(Volume({5, 5, 0}, {10, 10, 1}));
+    space.clear(Volume({9, 9, 0}, {2, 2, 1}));
+    ASSERT_EQ(space.find_sector({7, 7, 0}), nullptr);
+    ASSERT_EQ(space.overlapping_sectors(Volume({6, 6, 0}, {3, 3, 1})).size(), 0);
+    ASSERT_EQ(space.overlapping_sectors(Volume({9, 9, 0})).size(), 1);
+
+    for(int ii = 0; ii < 60; ii++){
+        Volume volume({position(prng), position(prng), position(prng) % 4},
+            {extent(prng), extent(prng), extent(prng) % 3 + 1});
+        if(ii % 3 == 2) space.block(volume);
+        else space.clear(volume);
+    }
+
+    // Every point reads the sector whose parts actually hold it
+    for(int xx = -1; xx < 24; xx++)
+    for(int yy = -1; yy < 24; yy++)
+    for(int zz = -1; zz < 8; zz++){
+        Point point(xx, yy, zz);
+        auto sector = space.find_sector(point);
+        if(sector){
+            ASSERT_TRUE(sector->parts.overlap(Volume(point)));
+        } else {
+            for(auto other : space.sectors())
+                ASSERT_FALSE(other->parts.overlap(Volume(point)));
+        }
+    }
+}
+
+TEST(space_tests, coarsen_merges_sectors){
+    SpaceProbe space;
+
+    // Build a grid of rooms and then tear the walls down again, which
+    // leaves the rooms and the bits of wall as separate sectors
+    space.clear(Volume({0, 0, 0}, {21, 21, 2}));
+    for(int ii = 0; ii <= 20; ii += 5){
+        space.block(Volume({ii, 0, 0}, {1, 21, 2}));
+        space.block(Volume({0, ii, 0}, {21, 1, 2}));
+    }
+    for(int ii = 0; ii <= 20; ii += 5){
+        space.clear(Volume({ii, 0, 0}, {1, 21, 2}));
+        space.clear(Volume({0, ii, 0}, {21, 1, 2}));
+    }
+    space.add_air({10, 10, 0}, 500);
+    space.step_n(0.01, 10);
+
+    uint before = space.size();
+    uint merged = space.coarsen();
+    ASSERT_GT(merged, 0);
+    ASSERT_EQ(space.size(), before - merged);
+    ASSERT_EQ(space.total_volume(), 21 * 21 * 2);
+
+    // Nothing is lost, and the graph matches the sectors
+    float mass = 0;
+    for(auto sector : space.sectors()){
+        mass += space.graph().gas_mass(sector->node);
+        float contact = 0;
+        for(auto other : space.sectors())
+            if(other != sector)
+                contact += sector->parts.contact(other->parts);
+        float edges = 0;
+        for(auto edge : space.graph().neighbours(sector->node))
+            edges += edge.second;
+        ASSERT_EQ(edges, contact);
+        ASSERT_EQ(space.graph().volume(sector->node), sector->parts.volume());
+    }
+    ASSERT_NEAR(mass, 500, 1e-2);
+    for(int xx = 0; xx < 21; xx++)
+        for(int yy = 0; yy < 21; yy++)
+            ASSERT_NE(space.find_sector({xx, yy, 1}), nullptr);
+
+    // Merging again finds nothing new to do
+    ASSERT_EQ(space.coarsen(), 0);
+}
+
+TEST(space_tests, doors_open_without_changing_sectors){
+    SpaceProbe space;
+
+    // Two rooms with a wall between them, and a door in the wall
+    space.clear(Volume({0, 0, 0}, {21, 10, 3}));
+    space.block(Volume({10, 0, 0}, {1, 10, 3}));
+    auto door = space.add_door(Volume({10, 4, 0}, {1, 2, 2}), 0);
+    space.add_air({0, 0, 0}, 1000);
+    uint sectors = space.size();
+
+    space.step_n(0.01, 100);
+    ASSERT_EQ(space.air_at({20, 9, 2}), 0);
+
+    // Open it, gas gets through and the sectors are untouched
+    space.set_door_openness(door, 1);
+    space.step_n(0.01, 100);
+    ASSERT_GT(space.air_at({20, 9, 2}), 0);
+    ASSERT_EQ(space.size(), sectors);
+
+    // Rebuilding the room behind the door still leaves it connected
+    space.block(Volume({15, 0, 0}, {1, 10, 3}));
+    space.clear(Volume({15, 0, 0}, {1, 10, 3}));
+    space.set_door_openness(door, 0);
+    float front = space.air_at({0, 0, 0});
+    space.step_n(0.01, 10);
+    ASSERT_EQ(space.air_at({0, 0, 0}), front);
+    space.set_door_openness(door, 1);
+    space.step_n(0.01, 10);
+    ASSERT_NE(space.air_at({0, 0, 0}), front);
+
+    // Without the door the rooms are apart again
+    space.remove_door(door);
+    ASSERT_EQ(space.air_at({10, 4, 0}), 0);
+}
+
+TEST(space_tests, exposure_vents_to_vacuum){
+    SpaceProbe space;
+
+    // A room with one wall open to space
+    space.clear(Volume({0, 0, 0}, {10, 10, 3}));
+    auto breach = space.expose(Volume({9, 0, 0}, {1, 10, 3}), 0);
+    uint sectors = space.size();
+    space.add_air({0, 0, 0}, 300);
+    space.step_n(0.01, 200);
+    float vented = space.air_at({0, 0, 0});
+    ASSERT_LT(vented, 1);
+    ASSERT_EQ(space.size(), sectors);
+
+    // Splitting the room leaves only the half at the breach venting
+    space.block(Volume({5, 0, 0}, {1, 10, 3}));
+    space.add_air({0, 0, 0}, 100);
+    space.add_air({9, 0, 0}, 100);
+    space.step_n(0.01, 200);
+    ASSERT_LT(space.air_at({9, 0, 0}), space.air_at({0, 0, 0}));
+    float sealed = space.air_at({0, 0, 0});
+    space.step_n(0.01, 10);
+    ASSERT_EQ(space.air_at({0, 0, 0}), sealed);
+
+    // Once patched the gas stays put
+    space.remove_exposure(breach);
+    space.add_air({9, 0, 0}, 100);
+    float patched = space.air_at({9, 0, 0});
+    space.step_n(0.01, 100);
+    ASSERT_NEAR(space.air_at({9, 0, 0}), patched, 1e-3);
+}
+
+TEST(space_tests, sources_follow_sectors){
+    SpaceProbe space;
+    space.clear(Volume({0, 0, 0}, {10, 10, 3}));
+
+    // A vent at a point, and a scrubber half in the wall that is off
+    auto vent = space.add_source(Point{1, 1, 1}, 30);
+    auto scrubber = space.add_source(Volume({9, 0, 0}, {2, 10, 3}), 0);
+    space.step_n(0.01, 100);
+    ASSERT_NEAR(space.air_at({5, 5, 1}) * 300, 30, 1e-2);
+
+    // Split the room, the vent keeps working on its own side
+    space.block(Volume({5, 0, 0}, {1, 10, 3}));
+    float right = space.air_at({8, 1, 1});
+    space.step_n(0.01, 100);
+    ASSERT_GT(space.air_at({1, 1, 1}), right);
+    ASSERT_NEAR(space.air_at({8, 1, 1}), right, 1e-5);
+
+    // Turn on the scrubber, only its half in the room has any effect
+    space.remove_source(vent);
+    space.set_source_rate(scrubber, -2 * right * 120);
+    float left = space.air_at({1, 1, 1});
+    space.step_n(0.01, 50);
+    ASSERT_NEAR(space.air_at({8, 1, 1}), right / 2, 1e-3);
+    ASSERT_EQ(space.air_at({1, 1, 1}), left);
+
+    // Opening the wall under the scrubber brings all of it into play
+    ASSERT_NEAR(space.source(scrubber).covered, 0.5, 1e-5);
+    space.clear(Volume({10, 0, 0}, {1, 10, 3}));
+    ASSERT_NEAR(space.source(scrubber).covered, 1, 1e-5);
+}
+
+TEST(space_tests, score_cache_matches_fresh_scores){
+    SpaceProbe cached, fresh;
+    for(auto space : {&cached, &fresh})
+        space->clear(Volume({0, 0, 0}, {10, 10, 2}));
+
+    // A score for a sector isn't reused once the sector has changed
+    auto sector = cached.sectors().front();
+    Volume fragment({10, 0, 0}, {2, 10, 2});
+    float before = cached.score_addition(sector, fragment);
+    cached.expand(sector, Volume({0, 10, 0}, {10, 4, 2}));
+    float after = cached.score_addition(sector, fragment);
+    ASSERT_NE(before, after);
+    cached.clear_score_cache();
+    ASSERT_EQ(after, cached.score_addition(sector, fragment));
+    fresh.expand(fresh.sectors().front(), Volume({0, 10, 0}, {10, 4, 2}));
+
+    // Offer the same fragments around the room over and over as it grows
+    // and shrinks, with and without the scores kept between them
+    std::mt19937_64 prng(2);
+    std::uniform_int_distribution<> position(-4, 16);
+    std::uniform_int_distribution<> extent(1, 4);
+    std::vector<Volume> fragments;
+    for(int ii = 0; ii < 8; ii++)
+        fragments.push_back(Volume({position(prng), position(prng), 0}, {extent(prng), extent(prng), 2}));
+    std::uniform_int_distribution<> pick(0, fragments.size() - 1);
+    for(int ii = 0; ii < 80; ii++){
+        auto volume = fragments[pick(prng)];
+        bool block = ii % 3 == 2;
+        for(auto space : {&cached, &fresh}){
+            if(space == &fresh) space->clear_score_cache();
+            if(block) space->block_cluster(Cluster{volume});
+            else space->clear_volume(volume);
+        }
+    }
+
+    // Every sector ends up with the same space either way
+    ASSERT_EQ(cached.size(), fresh.size());
+    for(uint ii = 0; ii < cached.sectors().size(); ii++)
+        ASSERT_TRUE(cached.sectors()[ii]->parts == fresh.sectors()[ii]->parts);
+}
@@ -328,6 +328,20 @@ TEST(volume_tests, overlap_operation){
     ASSERT_FALSE(c.overlap(a));
 }
 
+TEST(volume_tests, equality_operation){
+    Volume a({0, 0, 0}, {2, 2, 2});
+    ASSERT_TRUE(a == Volume({0, 0, 0}, {2, 2, 2}));
+    ASSERT_FALSE(a == Volume({1, 0, 0}, {2, 2, 2}));
+    ASSERT_TRUE(a != Volume({0, 0, 0}, {2, 2, 1}));
+
+    // Clusters with the same number of parts still differ by their parts
+    Cluster b{a};
+    Cluster c{Volume({5, 5, 5}, {1, 1, 1})};
+    ASSERT_TRUE(b != c);
+    ASSERT_FALSE(b == c);
+    ASSERT_TRUE(b == Cluster{a});
+}
+
 TEST(volume_tests, adjacent_operation){
     Volume a({0, 0, 0}, {1, 1, 1});
     Volume b({10, 10, 10}, {1, 1, 1});
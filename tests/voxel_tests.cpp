@@ -0,0 +1,49 @@
+#include <random>
+#include <map>
+
+#include "gtest/gtest.h"
+#include "VoxelIndex.hpp"
+
+TEST(voxel_tests, fill_against_brute_force){
+    std::mt19937_64 prng(10);
+    std::uniform_int_distribution<> position(-40, 40);
+    std::uniform_int_distribution<> length(1, 30);
+    std::uniform_int_distribution<> value(0, 3);
+
+    // Overlapping fills across chunk boundaries, including negative space
+    VoxelIndex index;
+    std::vector<std::pair<Volume, uint32_t>> fills;
+    for(int ii = 0; ii < 40; ii++){
+        Volume volume(Point(position(prng), position(prng), position(prng)), Size(length(prng), length(prng), length(prng)));
+        uint32_t id = value(prng);
+        index.fill(volume, id);
+        fills.emplace_back(volume, id);
+    }
+
+    for(int xx = -45; xx < 75; xx += 3)
+    for(int yy = -45; yy < 75; yy += 2)
+    for(int zz = -45; zz < 75; zz++){
+        uint32_t expected = 0;
+        for(auto fill : fills)
+            if(fill.first.contains(Point(xx, yy, zz)))
+                expected = fill.second;
+        ASSERT_EQ(index.get(Point(xx, yy, zz)), expected);
+    }
+}
+
+TEST(voxel_tests, uniform_chunks_stay_sparse){
+    VoxelIndex index;
+    index.fill(Volume(Point(0, 0, 0), Size(64, 64, 64)), 1);
+    ASSERT_EQ(index.chunks(), 64);
+    ASSERT_EQ(index.dense_chunks(), 0);
+
+    // Partially overwriting a chunk stores it, undoing that collapses it
+    index.fill(Volume(Point(5, 5, 5), Size(2, 2, 2)), 2);
+    ASSERT_EQ(index.dense_chunks(), 1);
+    ASSERT_EQ(index.get(Point(5, 6, 5)), 2);
+    index.fill(Volume(Point(5, 5, 5), Size(2, 2, 2)), 1);
+    ASSERT_EQ(index.dense_chunks(), 0);
+
+    index.fill(Volume(Point(0, 0, 0), Size(64, 64, 64)), 0);
+    ASSERT_EQ(index.chunks(), 0);
+}